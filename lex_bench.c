@@ -0,0 +1,703 @@
+/*
+// regex vm microbenchmark
+//
+// 同じパターン・入力に対して VM の各実装 (switch, 直接スレッディング)、決定化したもの
+// (表引き, Sheng) と POSIX regexec を走らせ
+//   ns/byte (エンジンごと)
+//   スレッドリストの最大占有数
+//   マッチ長とタグが regexec の最長一致と一致するか
+// を表示する。決定化できないパターンの DFA の列は - になる。続いて findMatch による非アンカー探索を regexec と、
+// nextMatchMulti で K 本の入力を交互に進めたときを1本ずつ nextMatch したときと比べる。
+// 最後に DFA を部分集合構成と導関数で作ったときのコンパイル時間と状態数を比べる。
+// 一致しないパターンがあれば終了コード 1 を返す。
+//
+// usage: lex_bench.out [pattern-name]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <regex.h>
+
+#include "lex_vm.h"
+#include "lex_dfa.h"
+
+
+#define MIN_BENCH_NS 200000000.0 // 1エンジンあたりの最低計測時間
+
+typedef struct {
+	char* name;
+	SymbolElement* el;
+	int num;
+	char* (*make_input)(void);
+} BenchCase;
+
+
+// 入力生成
+
+static char* repeatString(const char* unit,size_t times){
+	size_t len = strlen(unit);
+	char* buf = malloc(len*times + 1);
+	for(size_t i=0;i<times;i++) memcpy(buf + i*len,unit,len);
+	buf[len*times] = '\0';
+	return buf;
+}
+
+static char* inputCSource(void){
+	return repeatString(
+		"int bubble_sort(int *data, int size)\n"
+		"{\n"
+		"    int i; int j; /* loop counters */\n"
+		"    i = size - 1;\n"
+		"    while (0 < i) {\n"
+		"        if (*(data + (j+1)) < *(data + j) && i == 'x' || j)\n"
+		"            printf (\"%d\\n\", data);\n"
+		"        i = i - 1; goto retry;\n"
+		"    }\n"
+		"}\n",200);
+}
+
+static char* inputLongTokens(void){
+	return repeatString(
+		"    very_long_identifier_name_for_a_buffer_size = 1234567890123;\n"
+		"    printf (\"a fairly long string literal that goes on for a while\\n\");\n",100);
+}
+
+static char* inputNestedStar(void){ return repeatString("a",2000); }
+
+static char* inputAbab(void){ return repeatString("ab",1000); }
+
+static char* inputRedos(void){ return repeatString("x",1000); }
+
+static char* inputHugeAlt(void){
+	char* buf = malloc(8*3000 + 1);
+	char* p = buf;
+	for(int i=0;i<3000;i++){
+		// 3つに1つは候補に無い語 (k1xxx) になる
+		p += sprintf(p,"k%04d ",(i*7)%1500);
+	}
+	return buf;
+}
+
+// キーワード表の語 (決まった種から作る 4-8 文字の語)
+#define KEYWORD_NUM 1500
+static char keywords[KEYWORD_NUM][10];
+
+static char* inputKeywords(void){
+	char* buf = malloc(10*4000 + 1);
+	char* p = buf;
+	unsigned x = 12345;
+	for(int i=0;i<4000;i++){
+		x = x*1103515245 + 12345;
+		// 半分はキーワード、残りはその語の末尾を変えた識別子
+		p += sprintf(p,"%s%s ",keywords[(x >> 8) % KEYWORD_NUM],(x >> 4) & 1 ? "" : "q");
+	}
+	return buf;
+}
+
+static char* inputNearMiss(void){
+	return repeatString("abcdefghijklmnopqrstuvwxyz012345678_",200);
+}
+
+static char* inputLowerRun(void){
+	return repeatString("abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz.",60);
+}
+
+static char* inputOperators(void){
+	return repeatString("a=b==c;(d&&e)||f&g<h-i+j*k/l;",100);
+}
+
+static char* inputCounted(void){
+	return repeatString("12345678901234567890123 abc abcx ababab xxxxxxx 0x1f2e3d4c5b6a79887 ",40);
+}
+
+
+// パターン
+
+static SymbolElement c_tokens[] = {
+	{ "/\\*"                   , 1 },
+	{ "\\*/"                   , 2 },
+	{ "char"                   , 3 },
+	{ "else"                   , 4 },
+	{ "goto"                   , 5 },
+	{ "if"                     , 6 },
+	{ "int"                    , 7 },
+	{ "return"                 , 8 },
+	{ "void"                   , 9 },
+	{ "while"                  , 10 },
+	{ "=="                     , 11 },
+	{ "&&"                     , 12 },
+	{ "\\|\\|"                 , 13 },
+	{ ";"   , ';' }, { ":"   , ':' }, { "{"   , '{' },
+	{ "}"   , '}' }, { ","   , ',' }, { "="   , '=' },
+	{ "\\(" , '(' }, { "\\)" , ')' }, { "&"   , '&' },
+	{ "!"   , '!' }, { "-"   , '-' }, { "\\+" , '+' },
+	{ "\\*" , '*' }, { "/"   , '/' }, { "<"   , '<' },
+	{ "0|[1-9][0-9]*"                          , 14 },
+	{ "'(\\\\n|\\\\'|\\\\\\\\|[^\\\\'])'"      , 15 },
+	{ "\"(\\\\n|\\\\\"|\\\\\\\\|[^\\\\\"])*\"" , 16 },
+	{ "[_a-zA-Z][_a-zA-Z0-9]*"                 , 17 },
+	{ "[ \n\r\t]"                              , 0 },
+	{ "."                                      , 18 },
+};
+
+static SymbolElement nested_star[] = { { "(a*)*b" , 1 } };
+static SymbolElement abab[]        = { { "(a|b|ab)*c" , 1 }, { "." , 2 } };
+static SymbolElement redos[]       = { { "(x+x+)+y" , 1 }, { "." , 2 } };
+static SymbolElement near_miss[]   = { { "abcdefghijklmnopqrstuvwxyz0123456789" , 1 }, { "." , 2 } };
+static SymbolElement lower_run[]   = { { "[a-z]*[0-9]" , 1 }, { "." , 2 } };
+static SymbolElement huge_alt[]    = { { NULL , 1 }, { "[a-z0-9]+" , 2 }, { " " , 3 } };
+static SymbolElement operators[]   = {
+	{ "==" , 1 }, { "&&" , 2 }, { "\\|\\|" , 3 }, { ";" , 4 }, { "=" , 5 }, { "&" , 6 },
+	{ "\\(" , 7 }, { "\\)" , 8 }, { "<" , 9 }, { "[-+*/]" , 10 }, { "." , 11 },
+};
+static SymbolElement keyword_set[] = { { NULL , 1 }, { "[a-z]+" , 2 }, { " " , 3 } };
+static SymbolElement counted[]     = {
+	{ "[0-9]{1,20}" , 1 }, { "[a-z]{3}x?" , 2 }, { "(ab){2,3}" , 3 }, { "x{2,}" , 4 },
+	{ "0x[0-9a-f]{0,16}" , 5 }, { "[^ 0-9]{4}" , 6 }, { "." , 7 },
+};
+
+
+// k0000|k0001|...|k0999
+static void initHugeAlt(void){
+	char* reg = malloc(6*1000 + 1);
+	char* p = reg;
+	for(int i=0;i<1000;i++) p += sprintf(p,i?"|k%04d":"k%04d",i);
+	huge_alt[0].reg = reg;
+
+	// 密な DFA の表が大きくなる (comb 圧縮になる) キーワード表
+	unsigned x = 1;
+	reg = malloc(10*KEYWORD_NUM + 1);
+	p = reg;
+	for(int i=0;i<KEYWORD_NUM;i++){
+		x = x*1103515245 + 12345;
+		int len = 4 + (x >> 16) % 5;
+		for(int j=0;j<len;j++){
+			x = x*1103515245 + 12345;
+			keywords[i][j] = 'a' + (x >> 16) % 26;
+		}
+		keywords[i][len] = '\0';
+		p += sprintf(p,i?"|%s":"%s",keywords[i]);
+	}
+	keyword_set[0].reg = reg;
+}
+
+// 非アンカー探索 (findMatch) の入力
+static char* inputGrep(void){
+	char* src = inputCSource();
+	char* buf = malloc(strlen(src)*4 + 64);
+	char* p = buf;
+	for(int i=0;i<4;i++) p += sprintf(p,"%s",src);
+	sprintf(p,"    return bubble_sort_done(data, 42);\n");
+	free(src);
+	return buf;
+}
+
+static SymbolElement grep_prefix[]  = { { "bubble_sort_done" , 1 } };
+static SymbolElement grep_req[]     = { { "[a-z_]+_done\\(" , 1 } };
+static SymbolElement grep_first[]   = { { "[0-9][0-9]" , 1 } };
+static SymbolElement grep_rare[]    = { { "'x'|goto" , 1 } };
+static SymbolElement grep_counted[] = { { "[a-z]{4}_[a-z]{4}" , 1 } };
+
+#define CASE(n,el,f) { n, el, sizeof(el)/sizeof(SymbolElement), f }
+
+static BenchCase cases[] = {
+	CASE("c-tokens",    c_tokens,    inputCSource),
+	CASE("long-tokens", c_tokens,    inputLongTokens),
+	CASE("nested-star", nested_star, inputNestedStar),
+	CASE("abab-miss",   abab,        inputAbab),
+	CASE("redos",       redos,       inputRedos),
+	CASE("huge-alt",    huge_alt,    inputHugeAlt),
+	CASE("keywords",    keyword_set, inputKeywords),
+	CASE("near-miss",   near_miss,   inputNearMiss),
+	CASE("lower-run",   lower_run,   inputLowerRun),
+	CASE("operators",   operators,   inputOperators),
+	CASE("counted",     counted,     inputCounted),
+};
+
+static BenchCase multi_cases[] = {
+	CASE("c-tokens",    c_tokens,    inputCSource),
+	CASE("keywords",    keyword_set, inputKeywords),
+};
+
+static BenchCase search_cases[] = {
+	CASE("grep-prefix",  grep_prefix,  inputGrep),
+	CASE("grep-req",     grep_req,     inputGrep),
+	CASE("grep-first",   grep_first,   inputGrep),
+	CASE("grep-rare",    grep_rare,    inputGrep),
+	CASE("grep-counted", grep_counted, inputGrep),
+};
+
+
+
+
+// {n} {n,} {n,m} の形か
+static bool isBound(const char* reg){
+	const char* p = reg + 1;
+	if(*reg != '{' || !(*p >= '0' && *p <= '9')) return false;
+	while(*p >= '0' && *p <= '9') p++;
+	if(*p == ',') for(p++;*p >= '0' && *p <= '9';) p++;
+	return *p == '}';
+}
+
+// lex_parse.c の構文を POSIX ERE に書き換える
+// エスケープは記号にしか付かないので、ブラケット内だけ並べ替えが必要
+static char* toPosix(const char* reg){
+	char* out = malloc(strlen(reg)*2 + 8);
+	char* p = out;
+	*p++ = '^'; *p++ = '(';
+	while(*reg){
+		if(*reg == '['){
+			bool neg = false, rbracket = false, minus = false;
+			char body[512]; int n = 0;
+			reg++;
+			if(*reg == '^'){ neg = true; reg++; }
+			while(*reg && *reg != ']'){
+				char c = *reg++;
+				if(c == '\\') c = *reg++;
+				if(*reg == '-' && reg[1] != ']'){ // range
+					body[n++] = c; body[n++] = '-';
+					reg++;
+					c = *reg++;
+					if(c == '\\') c = *reg++;
+					body[n++] = c;
+					continue;
+				}
+				if(c == ']') rbracket = true;
+				else if(c == '-') minus = true;
+				else body[n++] = c;
+			}
+			reg++; // take ']'
+			*p++ = '[';
+			if(neg) *p++ = '^';
+			if(rbracket) *p++ = ']';
+			memcpy(p,body,n); p += n;
+			if(minus) *p++ = '-';
+			*p++ = ']';
+		}
+		else if(*reg == '\\'){
+			reg++;
+			if(*reg == ']') *p++ = *reg++;
+			else { *p++ = '\\'; *p++ = *reg++; }
+		}
+		else if(isBound(reg)){
+			while(*reg != '}') *p++ = *reg++;
+			*p++ = *reg++;
+		}
+		else if(*reg == '{' || *reg == '}'){ // 区間指定にならないものは文字
+			*p++ = '\\'; *p++ = *reg++;
+		}
+		else *p++ = *reg++;
+	}
+	*p++ = ')'; *p = '\0';
+	return out;
+}
+
+// regexec で最長一致 (同じ長さなら先のルール) を求める
+static int posixMatch(regex_t* re,SymbolElement* el,int num,char* str,int* len){
+	int tag = -1;
+	*len = 0;
+	for(int i=0;i<num;i++){
+		regmatch_t pm[1];
+		if(regexec(&re[i],str,1,pm,0) != 0) continue;
+		if(tag == -1 || pm[0].rm_eo > *len){
+			tag = el[i].tag;
+			*len = pm[0].rm_eo;
+		}
+	}
+	return tag;
+}
+
+static double nowNs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// 比較するエンジン
+typedef struct {
+	char* name;
+	int (*match)(Lexer* lex,char* str,size_t len,char** mSP);
+	bool (*usable)(Lexer* lex); // NULL なら常に使える
+} Engine;
+
+static int matchSwitch(Lexer* lex,char* str,size_t len,char** mSP){ return topMatch(lex->vc,str,len,mSP); }
+#if USE_THREADED
+static int matchThreaded(Lexer* lex,char* str,size_t len,char** mSP){ return topMatchThreaded(lex->vc,str,len,mSP); }
+#endif
+
+static int matchDFA(Lexer* lex,char* str,size_t len,char** mSP){ return runDFAScalar(lex->rules->dfa,str,str + len,mSP,NULL); }
+static int matchSheng(Lexer* lex,char* str,size_t len,char** mSP){ return runDFA(lex->rules->dfa,str,str + len,mSP,NULL); }
+static bool hasDFA(Lexer* lex){ return lex->rules->dfa != NULL; }
+static bool hasSheng(Lexer* lex){ return lex->rules->dfa != NULL && lex->rules->dfa->shuffle != NULL; }
+
+static Engine engines[] = {
+	{ "switch",   matchSwitch   },
+#if USE_THREADED
+	{ "threaded", matchThreaded },
+#endif
+	{ "dfa",      matchDFA,   hasDFA   },
+	{ "sheng",    matchSheng, hasSheng },
+};
+
+#define ENGINE_NUM (int)(sizeof(engines)/sizeof(Engine))
+
+// マッチしない位置は1文字進める (xcc はここで字句エラーにする)
+static void scanVM(Engine* e,Lexer* lex,char* input,char* end){
+	for(char* p = input;p < end;){
+		char* msp;
+		e->match(lex,p,end - p,&msp);
+		p = msp > p ? msp : p + 1;
+	}
+}
+
+static void scanPosix(regex_t* re,SymbolElement* el,int num,char* input){
+	for(char* p = input;*p;){
+		int len;
+		posixMatch(re,el,num,p,&len);
+		p += len ? len : 1;
+	}
+}
+
+// regexec と同じ結果になるか
+static bool checkEngine(Engine* e,BenchCase* bc,Lexer* lex,regex_t* re,char* input,char* end){
+	for(char* p = input;p < end;){
+		char* msp;
+		int len, ptag = posixMatch(re,bc->el,bc->num,p,&len);
+		int tag = e->match(lex,p,end - p,&msp);
+		if(tag != ptag || msp - p != len){
+			fprintf(stderr,"%s/%s: mismatch at %td: vm (tag %d, len %td) / regexec (tag %d, len %d)\n",
+					bc->name,e->name,p - input,tag,msp - p,ptag,len);
+			return false;
+		}
+		p += len ? len : 1;
+	}
+	return true;
+}
+
+static bool runCase(BenchCase* bc){
+	char* input = bc->make_input();
+	size_t bytes = strlen(input);
+	char* end = input + bytes;
+	Lexer lex = compileLex(input,bytes,bc->el,bc->num);
+
+	regex_t* re = malloc(sizeof(regex_t)*bc->num);
+	for(int i=0;i<bc->num;i++){
+		char* preg = toPosix(bc->el[i].reg);
+		int err = regcomp(&re[i],preg,REG_EXTENDED);
+		if(err){
+			char msg[128];
+			regerror(err,&re[i],msg,sizeof(msg));
+			fprintf(stderr,"%s: regcomp(%s): %s\n",bc->name,preg,msg);
+			exit(1);
+		}
+		free(preg);
+	}
+
+	// 差分検査
+	bool ok = true;
+	for(int i=0;i<ENGINE_NUM;i++){
+		if(engines[i].usable && !engines[i].usable(&lex)) continue;
+		ok &= checkEngine(&engines[i],bc,&lex,re,input,end);
+	}
+
+	// スレッド数
+	size_t peak = 0;
+#if LEX_STATS
+	for(char* p = input;p < end;){
+		char* msp;
+		VMStats st = {0};
+		topMatchStats(lex.vc,p,end - p,&msp,&st);
+		if(st.peak_cc > peak) peak = st.peak_cc;
+		p = msp > p ? msp : p + 1;
+	}
+#endif
+
+	// 計測
+	double t0,t1;
+	long iter;
+	printf("%-12s %7zu",bc->name,bytes);
+	for(int i=0;i<ENGINE_NUM;i++){
+		if(engines[i].usable && !engines[i].usable(&lex)){
+			printf(" %10s","-");
+			continue;
+		}
+		iter = 0;
+		t0 = nowNs();
+		do { scanVM(&engines[i],&lex,input,end); iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+		printf(" %10.2f",(t1 - t0) / ((double)iter*bytes));
+	}
+
+	iter = 0;
+	t0 = nowNs();
+	do { scanPosix(re,bc->el,bc->num,input); iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+	printf(" %10.2f %6zu   %s\n",(t1 - t0) / ((double)iter*bytes),peak,ok?"ok":"MISMATCH");
+
+	for(int i=0;i<bc->num;i++) regfree(&re[i]);
+	free(re);
+	freeLex(&lex);
+	free(input);
+	return ok;
+}
+
+// regexec で最も左の最長マッチを探す (空マッチの後は1つ進める)
+static int posixFind(regex_t* re,char* input,char* p,int* len){
+	regmatch_t pm[1];
+	if(regexec(re,p,1,pm,p > input ? REG_NOTBOL : 0) != 0) return -1;
+	*len = pm[0].rm_eo - pm[0].rm_so;
+	return (p - input) + pm[0].rm_so;
+}
+
+static size_t scanFind(Lexer* lex,char* input,size_t bytes){
+	Match m;
+	size_t n = 0;
+	resetLex(lex,input,bytes);
+	while(findMatch(lex,&m)) n++;
+	return n;
+}
+
+static size_t scanPosixFind(regex_t* re,char* input,size_t bytes){
+	size_t n = 0;
+	int len, at;
+	for(char* p = input;p <= input + bytes && (at = posixFind(re,input,p,&len)) >= 0;n++){
+		p = input + at + len + (len == 0);
+	}
+	return n;
+}
+
+static bool runSearch(BenchCase* bc){
+	char* input = bc->make_input();
+	size_t bytes = strlen(input);
+	LexRules rules = compileLexRules(bc->el,bc->num);
+	Lexer lex = openLex(&rules,input,bytes);
+	regex_t re;
+	char* preg = toPosix(bc->el[0].reg);
+	regcomp(&re,preg + 1,REG_EXTENDED); // '^' を外す
+	free(preg);
+
+	// 差分検査
+	bool ok = true;
+	Match m;
+	char* p = input;
+	int len, at;
+	size_t found = 0;
+	for(;;){
+		bool hit = findMatch(&lex,&m);
+		at = p <= input + bytes ? posixFind(&re,input,p,&len) : -1;
+		if(!hit || at < 0){
+			if(hit || at >= 0){
+				fprintf(stderr,"%s: findMatch %s / regexec %s\n",bc->name,hit?"found":"none",at>=0?"found":"none");
+				ok = false;
+			}
+			break;
+		}
+		if(m.str - input != at || m.num != len){
+			fprintf(stderr,"%s: mismatch: findMatch (%td, len %d) / regexec (%d, len %d)\n",
+					bc->name,m.str - input,m.num,at,len);
+			ok = false;
+			break;
+		}
+		found++;
+		p = input + at + len + (len == 0);
+	}
+
+	double t0,t1;
+	long iter = 0;
+	printf("%-12s %7zu %7zu",bc->name,bytes,found);
+	t0 = nowNs();
+	do { scanFind(&lex,input,bytes); iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+	printf(" %10.2f",(t1 - t0) / ((double)iter*bytes));
+	iter = 0;
+	t0 = nowNs();
+	do { scanPosixFind(&re,input,bytes); iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+	printf(" %10.2f   %s\n",(t1 - t0) / ((double)iter*bytes),ok?"ok":"MISMATCH");
+
+	regfree(&re);
+	closeLex(&lex);
+	freeLexRules(&rules);
+	free(input);
+	return ok;
+}
+
+// 入力を K 本に分けたもの (トークンの切れ目がそろわないよう、それぞれ違う位置から回す)
+static char** makeStreams(char* input,size_t bytes,int k){
+	char** in = malloc(sizeof(char*)*k);
+	for(int j=0;j<k;j++){
+		size_t off = (bytes / k) * j;
+		in[j] = malloc(bytes + 1);
+		memcpy(in[j],input + off,bytes - off);
+		memcpy(in[j] + bytes - off,input,off);
+		in[j][bytes] = '\0';
+	}
+	return in;
+}
+
+static size_t scanSingle(Lexer* lex,int k){
+	Match m;
+	size_t n = 0;
+	for(int j=0;j<k;j++){
+		resetLex(&lex[j],lex[j].str,lex[j].len);
+		while(nextMatch(&lex[j],&m)) n++;
+	}
+	return n;
+}
+
+#define MULTI_CAP 256 // nextMatchMulti 1回で1本あたりに受け取るマッチの数
+
+static size_t scanMulti(Lexer* lex,Lexer** lp,Match* m,int* count,int k){
+	size_t n = 0;
+	int found;
+	for(int j=0;j<k;j++) resetLex(&lex[j],lex[j].str,lex[j].len);
+	while((found = nextMatchMulti(lp,k,m,MULTI_CAP,count)) > 0) n += found;
+	return n;
+}
+
+static bool runMulti(BenchCase* bc,int k){
+	char* input = bc->make_input();
+	size_t bytes = strlen(input);
+	LexRules rules = compileLexRules(bc->el,bc->num);
+	char** in = makeStreams(input,bytes,k);
+	Lexer lex[LEX_MULTI_MAX],ref[LEX_MULTI_MAX],*lp[LEX_MULTI_MAX];
+	Match* m = malloc(sizeof(Match)*LEX_MULTI_MAX*MULTI_CAP);
+	int count[LEX_MULTI_MAX];
+	for(int j=0;j<k;j++){
+		lex[j] = openLex(&rules,in[j],bytes);
+		ref[j] = openLex(&rules,in[j],bytes);
+		lp[j] = &lex[j];
+	}
+
+	// 差分検査 (1本ずつ nextMatch したものと同じトークン列になるか)
+	bool ok = true;
+	while(ok && nextMatchMulti(lp,k,m,MULTI_CAP,count) > 0){
+		for(int j=0;j<k && ok;j++){
+			for(int t=0;t<count[j];t++){
+				Match a, *b = &m[j*MULTI_CAP + t];
+				nextMatch(&ref[j],&a);
+				if(a.str != b->str || a.tag != b->tag || a.num != b->num || a.look != b->look){
+					fprintf(stderr,"%s/multi%d: mismatch at %td\n",bc->name,k,b->str - in[j]);
+					ok = false;
+					break;
+				}
+			}
+		}
+	}
+	for(int j=0;j<k;j++) ok &= lex[j].end == ref[j].end;
+
+	double t0,t1;
+	long iter;
+	size_t tokens = 0;
+	printf("%-12s %2d %7zu",bc->name,k,bytes*k);
+	iter = 0;
+	t0 = nowNs();
+	do { tokens = scanSingle(lex,k); iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+	printf(" %10.2f",(t1 - t0) / ((double)iter*bytes*k));
+	iter = 0;
+	t0 = nowNs();
+	do { ok &= scanMulti(lex,lp,m,count,k) == tokens; iter++; } while((t1 = nowNs()) - t0 < MIN_BENCH_NS);
+	printf(" %10.2f   %s\n",(t1 - t0) / ((double)iter*bytes*k),ok?"ok":"MISMATCH");
+
+	for(int j=0;j<k;j++){
+		closeLex(&lex[j]);
+		closeLex(&ref[j]);
+		free(in[j]);
+	}
+	free(in);
+	free(m);
+	freeLexRules(&rules);
+	free(input);
+	return ok;
+}
+
+// 規則のコンパイルにかかる時間 (VM のコード生成を含む)
+static double compileNs(BenchCase* bc,bool deriv,LexRules* out){
+	double t0,t1;
+	long iter = 0;
+	t0 = nowNs();
+	do {
+		if(iter) freeLexRules(out);
+		*out = deriv ? compileLexRulesDeriv(bc->el,bc->num) : compileLexRules(bc->el,bc->num);
+		iter++;
+	} while((t1 = nowNs()) - t0 < MIN_BENCH_NS / 4);
+	return (t1 - t0) / iter;
+}
+
+// 部分集合構成 (+ 最小化) と導関数による構成を比べる
+static bool runCompile(BenchCase* bc){
+	LexRules sub,der;
+	double ts = compileNs(bc,false,&sub);
+	double td = compileNs(bc,true,&der);
+	char* input = bc->make_input();
+	size_t bytes = strlen(input);
+
+	// 差分検査 (導関数の DFA と VM で同じトークン列になるか)
+	LexRules vm = der;
+	vm.dfa = NULL;
+	Lexer a = openLex(&der,input,bytes), b = openLex(&vm,input,bytes);
+	bool ok = true;
+	for(;;){
+		Match ma,mb;
+		bool x = nextMatch(&a,&ma), y = nextMatch(&b,&mb);
+		if(x != y || ma.str != mb.str || ma.tag != mb.tag || ma.num != mb.num || ma.look != mb.look){
+			fprintf(stderr,"%s/deriv: mismatch at %td\n",bc->name,mb.str - input);
+			ok = false;
+			break;
+		}
+		if(!x) break;
+		if(ma.num == 0){ // 字句エラーは1文字飛ばす
+			seekLex(&a,a.index + 1);
+			seekLex(&b,b.index + 1);
+		}
+	}
+
+	printf("%-12s",bc->name);
+	if(sub.dfa) printf(" %7d",sub.dfa->state_num - 1);
+	else printf(" %7s","-");
+	printf(" %10.3f",ts/1e6);
+	if(der.dfa) printf(" %7d",der.dfa->state_num - 1);
+	else printf(" %7s","-");
+	printf(" %10.3f   %s\n",td/1e6,ok?"ok":"MISMATCH");
+
+	closeLex(&a);
+	closeLex(&b);
+	freeLexRules(&sub);
+	freeLexRules(&der);
+	free(input);
+	return ok;
+}
+
+int main(int argc,char* argv[]){
+	bool ok = true;
+	initHugeAlt();
+
+	printf("%-12s %7s","pattern","bytes");
+	for(int i=0;i<ENGINE_NUM;i++) printf(" %10s",engines[i].name);
+	printf(" %10s %6s   %s   (ns/byte)\n","posix","peak","check");
+	for(size_t i=0;i<sizeof(cases)/sizeof(BenchCase);i++){
+		if(argc > 1 && strcmp(argv[1],cases[i].name)) continue;
+		ok &= runCase(&cases[i]);
+	}
+
+	printf("\n%-12s %7s %7s %10s %10s   %s   (ns/byte)\n","search","bytes","found","findMatch","posix","check");
+	for(size_t i=0;i<sizeof(search_cases)/sizeof(BenchCase);i++){
+		if(argc > 1 && strcmp(argv[1],search_cases[i].name)) continue;
+		ok &= runSearch(&search_cases[i]);
+	}
+
+	printf("\n%-12s %2s %7s %10s %10s   %s   (ns/byte)\n","multi","K","bytes","single","lockstep","check");
+	for(size_t i=0;i<sizeof(multi_cases)/sizeof(BenchCase);i++){
+		if(argc > 1 && strcmp(argv[1],multi_cases[i].name)) continue;
+		for(int k=1;k<=LEX_MULTI_MAX;k*=2) ok &= runMulti(&multi_cases[i],k);
+	}
+
+	printf("\n%-12s %7s %10s %7s %10s   %s   (ms)\n","compile","states","subset","states","deriv","check");
+	for(size_t i=0;i<sizeof(cases)/sizeof(BenchCase);i++){
+		if(argc > 1 && strcmp(argv[1],cases[i].name)) continue;
+		ok &= runCompile(&cases[i]);
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,1035 @@
+/*
+// 決定化した字句解析器
+//
+// VM の1文字分の処理 (clist を広げて nlist を作る) を状態の集合に対してまとめて行い、
+// nlist に乗る命令の集合を DFA の状態とする。
+//   受理 : clist に乗る match のうち命令番号が最小のもの (同じ長さなら上に書いた規則)
+//   遷移 : 文字クラスの代表の文字で1文字進めたときの nlist
+// notchar は必ず any が続くので、match に届くかどうかは文字によらない。
+// count 命令はカウンタ値を状態に持てないので、ある場合は作らない (VM で実行する)。
+//
+// 実行は表引き (状態 -> 次の状態) が基本で、状態数が 16 以下のときは長いトークンの残りに Sheng 方式を使う。
+//   Sheng : 全状態の遷移先を xmm レジスタ1本に並べ、1文字ごとに pshufb 1回で進める。
+//           状態の依存の連鎖がメモリの読み込みを含まなくなる。
+//           準備とブロック単位の先読みの分だけ短いトークンでは表引きより遅いので、
+//           表引きで SHENG_HEAD 回進めても終わらないトークンだけ途中から切り替える。
+//           xcc の規則は状態が多く使えないので、USE_SHENG=1 で作ったとき (lex_bench) だけ組み込む。
+//   加速  : 識別子の本体や文字列の中身のように多くの文字で自分に戻る状態では、
+//           抜ける文字を 16 バイトずつまとめて探して一度に進める (truffle)。
+//           加速する状態は番号を末尾 (accel_base 以降) に集め、判定を比較1回にする。
+//   comb  : 密な表が LEX_DFA_DENSE_MAX を超えるときは、行ごとに最も多い遷移先を既定値として除き、
+//           残りを1本の配列に互いにずらして詰める (flex の base/next/check/default)。
+//           遷移ごとに check の比較が1回増えるが、キーワードの多い規則でも表がキャッシュに収まる。
+//   多入力: 独立な入力を最大 LEX_MULTI_MAX 本まとめて1文字ずつ交互に進める。1本では
+//           状態 -> 次の状態の読み込みが直列に並ぶが、別の入力の読み込みとは重ねられる。
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lex_parse.h"
+#include "lex_emit_code.h"
+#include "lex_dfa.h"
+
+#if USE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+
+
+// 状態 (nlist に乗る命令番号の昇順の列) の表
+// 最小化では状態の署名 (ブロック番号の列) を番号に変えるのにも、導関数による構成では式の表にも使う
+typedef struct {
+	int* set;            // すべての状態の命令番号を並べたもの
+	int* begin;          // 状態 s は set[begin[s] .. begin[s+1])
+	int num,alloced;
+	size_t set_len,set_alloced;
+	int* hash;           // 開番地法、-1 は空き
+	int hash_size;
+} StateTable;
+
+static unsigned hashSet(const int* a,int n){
+	unsigned h = 2166136261u;
+	for(int i=0;i<n;i++) h = (h ^ (unsigned)a[i]) * 16777619u;
+	return h;
+}
+
+static bool sameSet(const StateTable* t,int s,const int* a,int n){
+	return t->begin[s+1] - t->begin[s] == n && memcmp(&t->set[t->begin[s]],a,sizeof(int)*n) == 0;
+}
+
+static void rehash(StateTable* t){
+	t->hash_size *= 2;
+	t->hash = realloc(t->hash,sizeof(int)*t->hash_size);
+	for(int i=0;i<t->hash_size;i++) t->hash[i] = -1;
+	for(int s=0;s<t->num;s++){
+		unsigned h = hashSet(&t->set[t->begin[s]],t->begin[s+1] - t->begin[s]) & (t->hash_size - 1);
+		while(t->hash[h] >= 0) h = (h + 1) & (t->hash_size - 1);
+		t->hash[h] = s;
+	}
+}
+
+// 集合の状態番号を返す (無ければ追加する)
+static int internSet(StateTable* t,const int* a,int n){
+	unsigned h = hashSet(a,n) & (t->hash_size - 1);
+	for(;t->hash[h] >= 0;h = (h + 1) & (t->hash_size - 1)){
+		if(sameSet(t,t->hash[h],a,n)) return t->hash[h];
+	}
+	if(t->num + 2 > t->alloced){
+		t->alloced *= 2;
+		t->begin = realloc(t->begin,sizeof(int)*t->alloced);
+	}
+	if(t->set_len + n > t->set_alloced){
+		while(t->set_len + n > t->set_alloced) t->set_alloced *= 2;
+		t->set = realloc(t->set,sizeof(int)*t->set_alloced);
+	}
+	if(n) memcpy(&t->set[t->set_len],a,sizeof(int)*n); // 空の集合は a が NULL
+	t->set_len += n;
+	t->hash[h] = t->num;
+	t->begin[++t->num] = t->set_len;
+	if(t->num*2 > t->hash_size) rehash(t);
+	return t->num - 1;
+}
+
+static void initStateTable(StateTable* t){
+	t->alloced = 64;
+	t->begin = malloc(sizeof(int)*t->alloced);
+	t->begin[0] = 0;
+	t->num = 0;
+	t->set_alloced = 256;
+	t->set_len = 0;
+	t->set = malloc(sizeof(int)*t->set_alloced);
+	t->hash_size = 64;
+	t->hash = malloc(sizeof(int)*t->hash_size);
+	for(int i=0;i<t->hash_size;i++) t->hash[i] = -1;
+}
+
+static void freeStateTable(StateTable* t){
+	free(t->set);
+	free(t->begin);
+	free(t->hash);
+}
+
+static int compareInt(const void* a,const void* b){
+	return *(const int*)a - *(const int*)b;
+}
+
+// seed[0..n) から文字 c (eof なら終端) で1文字進め、nlist を out に昇順で返す
+// *match には clist に乗った match の最小の命令番号 (無ければ -1) を返す
+static int stepSet(const RegexVMCode* vc,const int* seed,int n,char_type c,bool eof,
+                   int* clist,int* out,unsigned char* mark,int* match){
+	const VMCode2* code = vc->code2;
+	int cc = 0, nc = 0;
+
+#define ADD(list,cnt,pc,bit) { if(!(mark[pc] & bit)){ mark[pc] |= bit; list[cnt++] = pc; } }
+	for(int i=0;i<n;i++) ADD(clist,cc,seed[i],1);
+	*match = -1;
+	for(int i=0;i<cc;i++){
+		const VMCode2* ins = &code[clist[i]];
+		switch(ins->op){
+			case VM_Char:     if(!eof && c == ins->a) ADD(out,nc,ins->next,2); break;
+			case VM_Range:    if(!eof && ins->a <= c && c <= ins->b) ADD(out,nc,ins->next,2); break;
+			case VM_Any:      if(!eof) ADD(out,nc,ins->next,2); break;
+			case VM_NotChar:  if(!eof && c != ins->a) ADD(clist,cc,ins->next,1); break;
+			case VM_NotRange: if(!eof && !(ins->a <= c && c <= ins->b)) ADD(clist,cc,ins->next,1); break;
+			case VM_Split:    ADD(clist,cc,ins->next,1); ADD(clist,cc,ins->x,1); break;
+			case VM_Jmp:      ADD(clist,cc,ins->next,1); break;
+			case VM_SplitN:   for(int j=0;j<ins->x;j++) ADD(clist,cc,vc->table[ins->next + j],1); break;
+			case VM_Match:    if(*match < 0 || clist[i] < *match) *match = clist[i]; break;
+		}
+	}
+#undef ADD
+	for(int i=0;i<cc;i++) mark[clist[i]] = 0;
+	for(int i=0;i<nc;i++) mark[out[i]] = 0;
+	qsort(out,nc,sizeof(int),compareInt);
+	return nc;
+}
+
+// cut[c+128] (c の直前で区間が切れる) から文字クラスを作る
+// (比較は char_type の大小なので、区間の境目は符号付きの順に並べて数える)
+static int cutClasses(const bool* cut,unsigned char* cls,char_type* rep){
+	int num = 0;
+	for(int i=0;i<256;i++){
+		if(i == 0 || cut[i]) rep[num++] = (char_type)(i - 128);
+		cls[(unsigned char)(char_type)(i - 128)] = num - 1;
+	}
+	return num;
+}
+
+// 文字を、どの命令から見ても区別できない区間ごとのクラスに分ける
+static int buildClasses(const RegexVMCode* vc,unsigned char* cls,char_type* rep){
+	bool cut[257] = {false};
+	for(size_t k=0;k<vc->opcode_size;k++){
+		const VMCode2* ins = &vc->code2[k];
+		int a = (int)ins->a + 128, b = (int)ins->b + 128;
+		switch(ins->op){
+			case VM_Char: case VM_NotChar:   cut[a] = cut[a+1] = true; break;
+			case VM_Range: case VM_NotRange: cut[a] = cut[b+1] = true; break;
+		}
+	}
+	return cutClasses(cut,cls,rep);
+}
+
+// Moore の分割で等価な状態をまとめる (命令の集合が違っても同じ振る舞いの状態は多い)
+// 死んだ状態は単独のブロックから始めるので、生きている状態とはまとまらない。
+// どこかで必ず死ぬ状態も死んだ状態とは区別するので、読んだ位置 (eSP) は VM と同じになる
+static void minimizeDFA(LexDFA* dfa){
+	int N = dfa->state_num, K = dfa->class_num;
+	int* block = malloc(sizeof(int)*N);
+	int* sig = malloc(sizeof(int)*(K + 1));
+	int num = 0, prev;
+
+	StateTable t;
+	initStateTable(&t);
+	for(int s=0;s<N;s++){
+		sig[0] = s == 0 ? -2 : dfa->accept[s];
+		block[s] = internSet(&t,sig,1);
+	}
+	num = t.num;
+	freeStateTable(&t);
+
+	do {
+		prev = num;
+		int* nb = malloc(sizeof(int)*N);
+		initStateTable(&t);
+		for(int s=0;s<N;s++){
+			sig[0] = block[s];
+			for(int k=0;k<K;k++) sig[k+1] = block[dfa->next[s*K + k]];
+			nb[s] = internSet(&t,sig,K + 1);
+		}
+		num = t.num;
+		freeStateTable(&t);
+		free(block);
+		block = nb;
+	} while(num != prev);
+
+	// 番号は s の小さい順に振られるので、死んだ状態は 0、初期状態は 1 のまま
+	dfa_state_type* next = malloc(sizeof(dfa_state_type)*num*K);
+	int* accept = malloc(sizeof(int)*num);
+	for(int s=0;s<N;s++){
+		for(int k=0;k<K;k++) next[block[s]*K + k] = block[dfa->next[s*K + k]];
+		accept[block[s]] = dfa->accept[s];
+	}
+	free(dfa->next);
+	free(dfa->accept);
+	dfa->next = next;
+	dfa->accept = accept;
+	dfa->state_num = num;
+
+	free(block);
+	free(sig);
+}
+
+// 自己ループする文字の表 (truffle 形式)
+//   c < 0x80 なら tbl[c & 15] の bit (c >> 4)、c >= 0x80 なら tbl[16 + (c & 15)] の bit ((c >> 4) & 7)
+#define ACCEL_IN(tbl,c) (((tbl)[((c) >> 7) * 16 + ((c) & 15)] >> (((c) >> 4) & 7)) & 1)
+
+// 加速する状態を決めて末尾に並べ替える (0 と 1 は動かさない)
+static void buildAccel(LexDFA* dfa){
+	int N = dfa->state_num, K = dfa->class_num;
+	int* order = malloc(sizeof(int)*N);  // 新しい番号 -> 古い番号
+	int* renum = malloc(sizeof(int)*N);  // 古い番号 -> 新しい番号
+	bool* acc = calloc(N,sizeof(bool));
+	int num = 0;
+
+	for(int s=2;s<N;s++){
+		int loops = 0;
+		for(int c=0;c<256;c++) loops += dfa->next[s*K + dfa->cls[c]] == s;
+		acc[s] = loops >= LEX_ACCEL_MIN;
+	}
+	for(int s=0;s<N;s++) if(!acc[s]) order[num++] = s;
+	dfa->accel_base = num;
+	for(int s=0;s<N;s++) if(acc[s]) order[num++] = s;
+	for(int s=0;s<N;s++) renum[order[s]] = s;
+
+	dfa_state_type* next = malloc(sizeof(dfa_state_type)*N*K);
+	int* accept = malloc(sizeof(int)*N);
+	for(int s=0;s<N;s++){
+		for(int k=0;k<K;k++) next[s*K + k] = renum[dfa->next[order[s]*K + k]];
+		accept[s] = dfa->accept[order[s]];
+	}
+	free(dfa->next);
+	free(dfa->accept);
+	dfa->next = next;
+	dfa->accept = accept;
+
+	if(dfa->accel_base < N){
+		dfa->accel = calloc(N - dfa->accel_base,32);
+		for(int s=dfa->accel_base;s<N;s++){
+			for(int c=0;c<256;c++){
+				if(next[s*K + dfa->cls[c]] == s) dfa->accel[s - dfa->accel_base][(c >> 7)*16 + (c & 15)] |= 1 << ((c >> 4) & 7);
+			}
+		}
+	}
+#if USE_SSSE3
+	dfa->accel_simd = __builtin_cpu_supports("ssse3");
+#endif
+
+	free(order);
+	free(renum);
+	free(acc);
+}
+
+#define COMB_EMPTY 0xffff // comb_check の空き (状態番号は LEX_DFA_MAX_STATES 未満)
+
+// skip を辿って i から先で最初の空きの位置を返す (埋まった位置 j は skip[j] = j + 1、経路は縮める)
+static int combFree(int* skip,int i){
+	int r = i;
+	while(skip[r] != r) r = skip[r];
+	while(skip[i] != r){
+		int n = skip[i];
+		skip[i] = r;
+		i = n;
+	}
+	return r;
+}
+
+// 密な表を comb 圧縮する (要素の多い行から順に、入る位置のうち最も手前に置く)
+// 位置の候補は最初の列が空きになるものだけを skip で飛びながら調べる
+static void buildComb(LexDFA* dfa){
+	int N = dfa->state_num, K = dfa->class_num;
+	int* order = malloc(sizeof(int)*N);
+	int* count = malloc(sizeof(int)*N);
+	int* cnt = malloc(sizeof(int)*N);    // 遷移先ごとの数 (既定値を決めるため)
+	int* cols = malloc(sizeof(int)*K);   // 既定値でない列 (置く位置を探すときはここだけ調べる)
+	int alloced = N + K, size = 0, free_min = 0;
+
+	dfa->comb_base = malloc(sizeof(int)*N);
+	dfa->comb_def = malloc(sizeof(dfa_state_type)*N);
+	dfa->comb_next = malloc(sizeof(dfa_state_type)*alloced);
+	dfa->comb_check = malloc(sizeof(dfa_state_type)*alloced);
+	int* skip = malloc(sizeof(int)*(alloced + 1)); // skip[alloced] は番兵
+	for(int i=0;i<alloced;i++) dfa->comb_check[i] = COMB_EMPTY;
+	for(int i=0;i<=alloced;i++) skip[i] = i;
+
+	for(int s=0;s<N;s++){
+		const dfa_state_type* row = &dfa->next[s*K];
+		int def = row[0];
+		for(int k=0;k<K;k++) cnt[row[k]] = 0;
+		for(int k=0;k<K;k++) if(++cnt[row[k]] > cnt[def]) def = row[k];
+		dfa->comb_def[s] = def;
+		count[s] = K - cnt[def];
+	}
+	// 要素の多い行から並べる (計数ソート)
+	int* start = calloc(K + 2,sizeof(int));
+	for(int s=0;s<N;s++) start[K - count[s] + 1]++;
+	for(int k=1;k<=K+1;k++) start[k] += start[k-1];
+	for(int s=0;s<N;s++) order[start[K - count[s]]++] = s;
+	free(start);
+
+	for(int j=0;j<N;j++){
+		int s = order[j];
+		const dfa_state_type* row = &dfa->next[s*K];
+		int b,nc = 0;
+		for(int k=0;k<K;k++) if(row[k] != dfa->comb_def[s]) cols[nc++] = k;
+		while(free_min < size && dfa->comb_check[free_min] != COMB_EMPTY) free_min++;
+		b = free_min > K ? free_min - K : 0;
+		for(int e = nc ? combFree(skip,b + cols[0]) : 0;nc;e = combFree(skip,e + 1)){
+			bool fit = true;
+			b = e - cols[0];
+			for(int i=1;i<nc && fit;i++){
+				if(b + cols[i] < alloced && dfa->comb_check[b + cols[i]] != COMB_EMPTY) fit = false;
+			}
+			if(fit) break;
+		}
+		if(b + K > alloced){
+			int old = alloced;
+			while(b + K > alloced) alloced *= 2;
+			dfa->comb_next = realloc(dfa->comb_next,sizeof(dfa_state_type)*alloced);
+			dfa->comb_check = realloc(dfa->comb_check,sizeof(dfa_state_type)*alloced);
+			skip = realloc(skip,sizeof(int)*(alloced + 1));
+			for(int i=old;i<alloced;i++) dfa->comb_check[i] = COMB_EMPTY;
+			for(int i=old + 1;i<=alloced;i++) skip[i] = i;
+		}
+		dfa->comb_base[s] = b;
+		for(int k=0;k<K;k++){
+			if(row[k] == dfa->comb_def[s]) continue;
+			dfa->comb_next[b + k] = row[k];
+			dfa->comb_check[b + k] = s;
+			skip[b + k] = b + k + 1;
+			if(b + k >= size) size = b + k + 1;
+		}
+	}
+
+	// どの行の base + k も配列の中に収まるようにする
+	int max_base = 0;
+	for(int s=0;s<N;s++) if(dfa->comb_base[s] > max_base) max_base = dfa->comb_base[s];
+	dfa->comb_size = max_base + K > size ? max_base + K : size;
+	dfa->comb_next = realloc(dfa->comb_next,sizeof(dfa_state_type)*dfa->comb_size);
+	dfa->comb_check = realloc(dfa->comb_check,sizeof(dfa_state_type)*dfa->comb_size);
+
+	free(dfa->next);
+	dfa->next = NULL;
+	free(order);
+	free(count);
+	free(cnt);
+	free(cols);
+	free(skip);
+}
+
+// 遷移表ができた後の実行用の準備 (加速、Sheng、comb)
+static void finishDFA(LexDFA* dfa){
+	buildAccel(dfa);
+
+#if USE_SHENG
+	if(dfa->state_num <= LEX_SHENG_STATES && __builtin_cpu_supports("ssse3")){
+		dfa->shuffle = calloc(256,16);
+		for(int c=0;c<256;c++){
+			for(int s=0;s<dfa->state_num;s++) dfa->shuffle[c][s] = dfa->next[s*dfa->class_num + dfa->cls[c]];
+		}
+	}
+#endif
+	if((size_t)dfa->state_num*dfa->class_num*sizeof(dfa_state_type) > LEX_DFA_DENSE_MAX) buildComb(dfa);
+}
+
+LexDFA* buildLexDFA(const RegexVMCode* vc){
+	if(vc->counter_num > 0 || vc->code2 == NULL) return NULL;
+
+	size_t n = vc->opcode_size;
+	LexDFA* dfa = calloc(1,sizeof(LexDFA));
+	char_type rep[256];
+	dfa->class_num = buildClasses(vc,dfa->cls,rep);
+
+	StateTable t;
+	initStateTable(&t);
+
+	int* clist = malloc(sizeof(int)*n);
+	int* out = malloc(sizeof(int)*n);
+	int* seed = malloc(sizeof(int)*n);
+	unsigned char* mark = calloc(n,1);
+	size_t alloced = 64;
+	dfa->next = malloc(sizeof(dfa_state_type)*alloced*dfa->class_num);
+	dfa->accept = malloc(sizeof(int)*alloced);
+
+	int start = 0;
+	internSet(&t,NULL,0);     // 0 : 死んだ状態
+	internSet(&t,&start,1);   // 1 : 初期状態 (命令 0 だけ)
+
+	for(int s=0;s<t.num;s++){
+		if((size_t)t.num > alloced){
+			while((size_t)t.num > alloced) alloced *= 2;
+			dfa->next = realloc(dfa->next,sizeof(dfa_state_type)*alloced*dfa->class_num);
+			dfa->accept = realloc(dfa->accept,sizeof(int)*alloced);
+		}
+		int len = t.begin[s+1] - t.begin[s];
+		memcpy(seed,&t.set[t.begin[s]],sizeof(int)*len); // internSet で set が動くので写しておく
+		int match;
+		stepSet(vc,seed,len,'\0',true,clist,out,mark,&match);
+		dfa->accept[s] = match < 0 ? -1 : vc->code2[match].x;
+		for(int k=0;k<dfa->class_num;k++){
+			int nc = stepSet(vc,seed,len,rep[k],false,clist,out,mark,&match);
+			int d = internSet(&t,out,nc);
+			if(t.num > LEX_DFA_MAX_STATES) goto too_many;
+			dfa->next[s*dfa->class_num + k] = d;
+		}
+	}
+	dfa->state_num = t.num;
+	minimizeDFA(dfa);
+	finishDFA(dfa);
+
+	free(clist); free(out); free(seed); free(mark);
+	freeStateTable(&t);
+	return dfa;
+
+too_many:
+	free(clist); free(out); free(seed); free(mark);
+	freeStateTable(&t);
+	freeLexDFA(dfa);
+	return NULL;
+}
+
+/*
+// 導関数による構成 (buildLexDFADeriv)
+//
+// バイトコードを経由せず、規則ごとの正規表現 r_i の列を状態とする。文字 c で進んだ先は
+// 導関数 d_c(r_i) (c で始まる語から c を除いたものの集合) の列になる。
+// 式は種類と子の番号の列として StateTable に登録し (hash-consing)、同じ式は同じ番号になる。
+// 作るときに次のように正規化するので、状態は有限で、最小化しなくてもほぼ最小になる
+//   ∅r = r∅ = ∅, εr = rε = r, (rs)t = r(st)
+//   r|s は | を平らにして ∅ を除き、文字集合は1つにまとめ、番号順に並べて重複を除く
+//   r** = r*, ∅* = ε* = ε, r{0,} = r*, r{1,1} = r
+// 受理 : ε を含む r_i のうち最初の規則のタグ。死んだ状態 : すべての r_i が ∅
+// 空の文字集合は ∅ にしない (VM ではそのスレッドが次の1文字まで生きているので、eSP を合わせる)。
+// 有界繰り返しは展開せずに回数を式に持つので、count 命令のある規則でも作れる。
+*/
+
+enum { RE_EMPTY, RE_EPS, RE_SET, RE_CAT, RE_ALT, RE_STAR, RE_REP };
+
+#define RE_NODE_MAX (1 << 20) // 式がこれより増えるなら作らない
+
+typedef struct {
+	StateTable t;            // 式の表 (列の先頭が種類、SET は 32バイトの文字の表、他は子の番号)
+	bool* nullable;          // ε を含むか
+	int** deriv;             // deriv[e][k] : 文字クラス k での導関数 (-1 は未計算、行は使うときに作る)
+	int alloced;
+	int K;
+	const char_type* rep;    // 文字クラスの代表の文字
+	int empty,eps;
+} ReTable;
+
+static inline int reKind(const ReTable* r,int e){ return r->t.set[r->t.begin[e]]; }
+
+// a は表の中を指していてはいけない (登録で表が動く)
+static int reIntern(ReTable* r,const int* a,int n){
+	int old = r->t.num;
+	int e = internSet(&r->t,a,n);
+	if(r->t.num == old) return e; // 登録済み
+	if(r->t.num > r->alloced){
+		r->alloced = r->t.num*2;
+		r->nullable = realloc(r->nullable,sizeof(bool)*r->alloced);
+		r->deriv = realloc(r->deriv,sizeof(int*)*r->alloced);
+	}
+	bool nl = false;
+	switch(a[0]){
+		case RE_EPS: case RE_STAR: nl = true; break;
+		case RE_CAT: nl = r->nullable[a[1]] && r->nullable[a[2]]; break;
+		case RE_ALT: for(int i=1;i<n;i++) nl |= r->nullable[a[i]]; break;
+		case RE_REP: nl = a[2] == 0 || r->nullable[a[1]]; break;
+	}
+	r->nullable[e] = nl;
+	r->deriv[e] = NULL;
+	return e;
+}
+
+static int reSet(ReTable* r,const unsigned char* bits){
+	int a[1 + 8];
+	a[0] = RE_SET;
+	memcpy(&a[1],bits,32);
+	return reIntern(r,a,1 + 8);
+}
+
+static int reCat(ReTable* r,int x,int y){
+	if(x == r->empty || y == r->empty) return r->empty;
+	if(x == r->eps) return y;
+	if(y == r->eps) return x;
+	if(reKind(r,x) == RE_CAT){ // 右結合にそろえる (左の子は CAT でないので深くならない)
+		int x1 = r->t.set[r->t.begin[x] + 1], x2 = r->t.set[r->t.begin[x] + 2];
+		return reCat(r,x1,reCat(r,x2,y));
+	}
+	int a[3] = { RE_CAT,x,y };
+	return reIntern(r,a,3);
+}
+
+// kids[0..n) の選択
+static int reAlt(ReTable* r,const int* kids,int n){
+	int num = 0, alloced = n + 2;
+	for(int i=0;i<n;i++) if(reKind(r,kids[i]) == RE_ALT) alloced += r->t.begin[kids[i]+1] - r->t.begin[kids[i]];
+	int* a = malloc(sizeof(int)*alloced);
+	unsigned char bits[32] = {0};
+	bool has_set = false;
+
+	for(int i=0;i<n;i++){
+		int b = r->t.begin[kids[i]], len = r->t.begin[kids[i]+1] - b;
+		const int* sub = reKind(r,kids[i]) == RE_ALT ? &r->t.set[b + 1] : &kids[i];
+		if(reKind(r,kids[i]) != RE_ALT) len = 2;
+		for(int j=0;j<len-1;j++){
+			int e = sub[j];
+			switch(reKind(r,e)){
+				case RE_EMPTY: break;
+				case RE_SET:
+					for(int c=0;c<32;c++) bits[c] |= ((const unsigned char*)&r->t.set[r->t.begin[e] + 1])[c];
+					has_set = true;
+					break;
+				default: a[1 + num++] = e; break;
+			}
+		}
+	}
+	if(has_set) a[1 + num++] = reSet(r,bits); // 文字集合は1つにまとめる
+	qsort(&a[1],num,sizeof(int),compareInt);
+	int m = 0;
+	for(int i=0;i<num;i++) if(m == 0 || a[1 + m - 1] != a[1 + i]) a[1 + m++] = a[1 + i];
+
+	int e;
+	if(m == 0) e = r->empty;
+	else if(m == 1) e = a[1];
+	else {
+		a[0] = RE_ALT;
+		e = reIntern(r,a,1 + m);
+	}
+	free(a);
+	return e;
+}
+
+static int reAlt2(ReTable* r,int x,int y){
+	int kids[2] = { x,y };
+	return reAlt(r,kids,2);
+}
+
+static int reStar(ReTable* r,int x){
+	if(x == r->empty || x == r->eps || reKind(r,x) == RE_STAR) return x == r->empty ? r->eps : x;
+	int a[2] = { RE_STAR,x };
+	return reIntern(r,a,2);
+}
+
+static int reRep(ReTable* r,int x,int min,int max){
+	if(max == 0) return r->eps;
+	if(min == 0 && max < 0) return reStar(r,x);
+	if(min == 1 && max == 1) return x;
+	if(x == r->eps) return r->eps;
+	if(x == r->empty) return min == 0 ? r->eps : r->empty;
+	int a[4] = { RE_REP,x,min,max };
+	return reIntern(r,a,4);
+}
+
+static int reDeriv(ReTable* r,int e,int k){
+	if(r->deriv[e] && r->deriv[e][k] >= 0) return r->deriv[e][k];
+	int b = r->t.begin[e], len = r->t.begin[e+1] - b;
+	int a[4], d = r->empty;
+	if(len <= 4) memcpy(a,&r->t.set[b],sizeof(int)*len);
+
+	switch(r->t.set[b]){
+		case RE_EMPTY: case RE_EPS: break;
+		case RE_SET:{
+			unsigned char c = (unsigned char)r->rep[k];
+			if(((const unsigned char*)&r->t.set[b + 1])[c >> 3] >> (c & 7) & 1) d = r->eps;
+			break;
+		}
+		case RE_CAT:
+			d = reCat(r,reDeriv(r,a[1],k),a[2]);
+			if(r->nullable[a[1]]) d = reAlt2(r,d,reDeriv(r,a[2],k));
+			break;
+		case RE_ALT:{
+			int* kids = malloc(sizeof(int)*(len - 1));
+			memcpy(kids,&r->t.set[b + 1],sizeof(int)*(len - 1));
+			for(int i=0;i<len-1;i++) kids[i] = reDeriv(r,kids[i],k);
+			d = reAlt(r,kids,len - 1);
+			free(kids);
+			break;
+		}
+		case RE_STAR: d = reCat(r,reDeriv(r,a[1],k),e); break;
+		case RE_REP:
+			d = reCat(r,reDeriv(r,a[1],k),reRep(r,a[1],a[2] > 0 ? a[2] - 1 : 0,a[3] < 0 ? -1 : a[3] - 1));
+			break;
+	}
+	if(r->deriv[e] == NULL){
+		r->deriv[e] = malloc(sizeof(int)*r->K);
+		for(int i=0;i<r->K;i++) r->deriv[e][i] = -1;
+	}
+	r->deriv[e][k] = d;
+	return d;
+}
+
+// [^ ] の中身の文字を bits から除く (VM と同じく char,range,or 以外は無視する)
+static void clearNotBits(RegexAST* ast,unsigned char* bits){
+	if(ast == NULL) return;
+	for(int u=0;u<256;u++){
+		char_type c = (char_type)u;
+		if((ast->type == Char && c == ast->c) || (ast->type == Range && ast->begin <= c && c <= ast->end)) bits[u >> 3] &= ~(1 << (u & 7));
+	}
+	if(ast->type == Or){
+		clearNotBits(ast->lhs,bits);
+		clearNotBits(ast->rhs,bits);
+	}
+}
+
+static int reFromAST(ReTable* r,RegexAST* ast);
+
+// a|b|c|... の選択肢を集める (1つずつ reAlt2 でまとめると選択肢の数の2乗かかる)
+static void collectOr(ReTable* r,RegexAST* ast,int** kids,int* n,int* alloced){
+	if(ast != NULL && ast->type == Or){
+		collectOr(r,ast->lhs,kids,n,alloced);
+		collectOr(r,ast->rhs,kids,n,alloced);
+		return;
+	}
+	int e = reFromAST(r,ast);
+	if(*n == *alloced){
+		*alloced = *alloced ? *alloced*2 : 16;
+		*kids = realloc(*kids,sizeof(int)*(*alloced));
+	}
+	(*kids)[(*n)++] = e;
+}
+
+static int reFromAST(ReTable* r,RegexAST* ast){
+	unsigned char bits[32] = {0};
+	if(ast == NULL) return r->eps;
+	switch(ast->type){
+		case Char:     bits[(unsigned char)ast->c >> 3] |= 1 << ((unsigned char)ast->c & 7); return reSet(r,bits);
+		case Range:
+			for(int u=0;u<256;u++) if(ast->begin <= (char_type)u && (char_type)u <= ast->end) bits[u >> 3] |= 1 << (u & 7);
+			return reSet(r,bits);
+		case Dot:      memset(bits,0xff,32); return reSet(r,bits);
+		case Not:      memset(bits,0xff,32); clearNotBits(ast->lhs,bits); return reSet(r,bits);
+		case Connect:  return reCat(r,reFromAST(r,ast->lhs),reFromAST(r,ast->rhs));
+		case Or:{
+			int* kids = NULL;
+			int n = 0,alloced = 0;
+			collectOr(r,ast,&kids,&n,&alloced);
+			int e = reAlt(r,kids,n);
+			free(kids);
+			return e;
+		}
+		case Star:     return reStar(r,reFromAST(r,ast->lhs));
+		case Question: return reAlt2(r,r->eps,reFromAST(r,ast->lhs));
+		case Plus:{
+			int x = reFromAST(r,ast->lhs);
+			return reCat(r,x,reStar(r,x));
+		}
+		case Repeat:   return reRep(r,reFromAST(r,ast->lhs),ast->min,ast->max);
+	}
+	return r->empty;
+}
+
+// 文字クラスの境目を AST の文字と範囲から集める (buildClasses と同じ区切り方)
+static void cutAST(RegexAST* ast,bool* cut){
+	if(ast == NULL) return;
+	switch(ast->type){
+		case Char:  cut[(int)ast->c + 128] = cut[(int)ast->c + 129] = true; return;
+		case Range: cut[(int)ast->begin + 128] = cut[(int)ast->end + 129] = true; return;
+		case Dot:   return;
+		default:
+			cutAST(ast->lhs,cut);
+			if(ast->type == Connect || ast->type == Or) cutAST(ast->rhs,cut);
+			return;
+	}
+}
+
+LexDFA* buildLexDFADeriv(RegexAST** asts,const int* tags,int num){
+	LexDFA* dfa = calloc(1,sizeof(LexDFA));
+	char_type rep[256];
+	bool cut[257] = {false};
+	for(int i=0;i<num;i++) cutAST(asts[i],cut);
+	int K = dfa->class_num = cutClasses(cut,dfa->cls,rep);
+
+	ReTable r = { .K = K, .rep = rep };
+	initStateTable(&r.t);
+	int a = RE_EMPTY;
+	r.empty = reIntern(&r,&a,1);
+	a = RE_EPS;
+	r.eps = reIntern(&r,&a,1);
+
+	// 状態は (規則の番号, 式) の組を規則の順に並べたもの (∅ の規則は除く)
+	StateTable t;
+	initStateTable(&t);
+	int* vec = malloc(sizeof(int)*2*num);
+	int* seed = malloc(sizeof(int)*2*num);
+	size_t alloced = 64;
+	dfa->next = malloc(sizeof(dfa_state_type)*alloced*K);
+	dfa->accept = malloc(sizeof(int)*alloced);
+
+	int n = 0;
+	for(int i=0;i<num;i++){
+		int e = reFromAST(&r,asts[i]);
+		if(e != r.empty){ vec[n++] = i; vec[n++] = e; }
+	}
+	internSet(&t,NULL,0);  // 0 : 死んだ状態
+	internSet(&t,vec,n);   // 1 : 初期状態
+
+	for(int s=0;s<t.num;s++){
+		if((size_t)t.num > alloced){
+			while((size_t)t.num > alloced) alloced *= 2;
+			dfa->next = realloc(dfa->next,sizeof(dfa_state_type)*alloced*K);
+			dfa->accept = realloc(dfa->accept,sizeof(int)*alloced);
+		}
+		int len = t.begin[s+1] - t.begin[s];
+		memcpy(seed,&t.set[t.begin[s]],sizeof(int)*len);
+		dfa->accept[s] = -1;
+		for(int j=0;j<len;j+=2){
+			if(r.nullable[seed[j+1]]){ dfa->accept[s] = tags[seed[j]]; break; }
+		}
+		for(int k=0;k<K;k++){
+			n = 0;
+			for(int j=0;j<len;j+=2){
+				int d = reDeriv(&r,seed[j+1],k);
+				if(d != r.empty){ vec[n++] = seed[j]; vec[n++] = d; }
+			}
+			int d = internSet(&t,vec,n);
+			if(t.num > LEX_DFA_MAX_STATES || r.t.num > RE_NODE_MAX) goto too_many;
+			dfa->next[s*K + k] = d;
+		}
+	}
+	dfa->state_num = t.num;
+	finishDFA(dfa);
+	goto done;
+
+too_many:
+	freeLexDFA(dfa);
+	dfa = NULL;
+done:
+	for(int e=0;e<r.t.num;e++) free(r.deriv[e]);
+	free(r.deriv);
+	free(r.nullable);
+	freeStateTable(&r.t);
+	freeStateTable(&t);
+	free(vec);
+	free(seed);
+	return dfa;
+}
+
+void freeLexDFA(LexDFA* dfa){
+	if(dfa == NULL) return;
+	free(dfa->next);
+	free(dfa->accept);
+	free(dfa->shuffle);
+	free(dfa->accel);
+	free(dfa->comb_base);
+	free(dfa->comb_def);
+	free(dfa->comb_next);
+	free(dfa->comb_check);
+	free(dfa);
+}
+
+// 状態 s から文字 c で進んだ先 (密な表でも comb でも)
+static inline int nextState(const LexDFA* dfa,int s,unsigned char c){
+	if(dfa->comb_size){
+		int i = dfa->comb_base[s] + dfa->cls[c];
+		return dfa->comb_check[i] == s ? dfa->comb_next[i] : dfa->comb_def[s];
+	}
+	return dfa->next[s*dfa->class_num + dfa->cls[c]];
+}
+
+void profileDFA(const LexDFA* dfa,char* str,char* end,size_t* hits){
+	int s = 1;
+	hits[1]++;
+	for(char* p = str;p < end;p++){
+		s = nextState(dfa,s,(unsigned char)*p);
+		if(s == 0) break;
+		hits[s]++;
+	}
+}
+
+// 状態 s から t に進む文字を [a-z] のような区間の列で書く (半分より多いときは補集合を ^ で)
+static void printDotEdgeLabel(FILE* fp,const LexDFA* dfa,int s,int t){
+	bool in[256];
+	int num = 0;
+	for(int c = 0;c < 256;c++) num += in[c] = nextState(dfa,s,c) == t;
+	bool neg = num > 128;
+	if(neg) fprintf(fp,"^");
+	for(int c = 0;c < 256;c++){
+		if(in[c] == neg) continue;
+		int e = c;
+		while(e + 1 < 256 && in[e + 1] != neg) e++;
+		printDotChar(fp,(char_type)c);
+		if(e > c){
+			if(e > c + 1) fprintf(fp,"-");
+			printDotChar(fp,(char_type)e);
+		}
+		c = e;
+	}
+}
+
+void printLexDFADot(const LexDFA* dfa,const size_t* hits,const char* (*tag_name)(int),FILE* fp){
+	size_t max = 0;
+	if(hits) for(int s = 1;s < dfa->state_num;s++) if(hits[s] > max) max = hits[s];
+
+	for(int s = 1;s < dfa->state_num;s++){ // 死んだ状態 0 は書かない
+		fprintf(fp,"        d%d [label = \"%d",s,s);
+		if(dfa->accept[s] >= 0){
+			if(tag_name) fprintf(fp,"\\n%s",tag_name(dfa->accept[s]));
+			else fprintf(fp,"\\n%d",dfa->accept[s]);
+		}
+		if(hits) fprintf(fp,"\\n%zu",hits[s]);
+		fprintf(fp,"\", shape = %s",dfa->accept[s] >= 0 ? "doublecircle" : "circle");
+		if(s == 1) fprintf(fp,", penwidth = 2");
+		if(hits){ fprintf(fp,", "); printDotHeat(fp,hits[s],max); }
+		fprintf(fp,"];\n");
+	}
+
+	// 遷移先ごとに1本の辺にまとめる
+	unsigned char* done = calloc(dfa->state_num,1);
+	for(int s = 1;s < dfa->state_num;s++){
+		for(int c = 0;c < 256;c++){
+			int t = nextState(dfa,s,c);
+			if(t == 0 || done[t]) continue;
+			done[t] = 1;
+			fprintf(fp,"        d%d -> d%d [label = \"",s,t);
+			printDotEdgeLabel(fp,dfa,s,t);
+			fprintf(fp,"\"];\n");
+		}
+		for(int c = 0;c < 256;c++) done[nextState(dfa,s,c)] = 0;
+	}
+	free(done);
+}
+
+#if USE_SSSE3
+// p から tbl に入っている文字を読み飛ばし、最初に入っていない文字の位置を返す
+__attribute__((target("ssse3")))
+static char* skipLoopSIMD(const unsigned char* tbl,char* p,char* end){
+	const __m128i lo = _mm_loadu_si128((const __m128i*)tbl);
+	const __m128i hi = _mm_loadu_si128((const __m128i*)(tbl + 16));
+	const __m128i bits = _mm_setr_epi8(1,2,4,8,16,32,64,-128,1,2,4,8,16,32,64,-128);
+	const __m128i low4 = _mm_set1_epi8(0x0f);
+	const __m128i top = _mm_set1_epi8(-128);
+	for(;end - p >= 16;p += 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		// pshufb は添字の bit7 が立つと 0 を返すので、lo と hi で半分ずつ引ける
+		__m128i t = _mm_or_si128(_mm_shuffle_epi8(lo,v),_mm_shuffle_epi8(hi,_mm_xor_si128(v,top)));
+		__m128i b = _mm_shuffle_epi8(bits,_mm_and_si128(_mm_srli_epi16(v,4),low4));
+		unsigned out = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(t,b),_mm_setzero_si128()));
+		if(out) return p + __builtin_ctz(out);
+	}
+	while(p < end && ACCEL_IN(tbl,(unsigned char)*p)) p++;
+	return p;
+}
+#endif
+
+// 加速する状態 s にいるとき、自己ループで読める文字をまとめて読み飛ばす
+static inline char* skipLoop(const LexDFA* dfa,int s,char* p,char* end){
+	const unsigned char* tbl = dfa->accel[s - dfa->accel_base];
+#if USE_SSSE3
+	if(dfa->accel_simd) return skipLoopSIMD(tbl,p,end);
+#endif
+	while(p < end && ACCEL_IN(tbl,(unsigned char)*p)) p++;
+	return p;
+}
+
+#if USE_SHENG
+#define SHENG_BLOCK 8  // 長いトークンではこの文字数ずつまとめて進める
+#define SHENG_HEAD  16 // 最初はこの文字数まで表引きで進める (短いトークンでは Sheng の準備と先読みが損になる)
+
+// 状態は xmm の全バイトに同じ値で持つ。pshufb の添字はそのまま状態番号になる
+// 死んだ状態 0 からは 0 にしか行かないので、ブロックの途中で死んでもまとめて進めてから調べる
+#define SHENG_STEP(c) (v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)shuffle[(unsigned char)(c)]),v))
+
+// 表引きで SHENG_HEAD 文字進めても終わらなかったトークンの続き (状態 s、位置 p から)
+__attribute__((target("ssse3")))
+static int runSheng(const LexDFA* dfa,int s,int tag,char* p,char* end,char** mSP,char** eSP){
+	const unsigned char (*shuffle)[16] = (const unsigned char (*)[16])dfa->shuffle;
+	const int* accept = dfa->accept;
+	__m128i v = _mm_set1_epi8((char)s);
+	unsigned char st[SHENG_BLOCK];
+
+	while(end - p >= SHENG_BLOCK){
+		for(int k=0;k<SHENG_BLOCK;k++) st[k] = (unsigned char)_mm_cvtsi128_si32(SHENG_STEP(p[k]));
+		for(int k=0;k<SHENG_BLOCK;k++){
+			if(st[k] == 0){
+				p += k;
+				goto done;
+			}
+			if(accept[st[k]] >= 0){
+				tag = accept[st[k]];
+				*mSP = p + k + 1;
+			}
+		}
+		p += SHENG_BLOCK;
+		if(st[SHENG_BLOCK-1] >= dfa->accel_base){ // ブロックの終わりで自己ループにいれば読み飛ばす
+			s = st[SHENG_BLOCK-1];
+			char* q = skipLoop(dfa,s,p,end);
+			if(q > p && accept[s] >= 0) *mSP = q;
+			p = q;
+		}
+	}
+	while(p < end){
+		s = (unsigned char)_mm_cvtsi128_si32(SHENG_STEP(*p));
+		if(s == 0) break;
+		p++;
+		if(s >= dfa->accel_base) p = skipLoop(dfa,s,p,end);
+		if(accept[s] >= 0){
+			tag = accept[s];
+			*mSP = p;
+		}
+	}
+done:
+	if(eSP) *eSP = p;
+	return tag;
+}
+#undef SHENG_STEP
+#endif
+
+// comb,sheng が定数の呼び出しはインライン展開で表の引き方が1通りになる
+// sheng なら表引きで SHENG_HEAD 回進めても終わらないトークンの残りを runSheng に任せる
+// (加速で読み飛ばした文字は数えない)
+static inline int runTable(const LexDFA* dfa,char* str,char* end,char** mSP,char** eSP,bool comb,bool sheng){
+	const dfa_state_type* next = dfa->next;
+	const unsigned char* cls = dfa->cls;
+	int K = dfa->class_num;
+	int s = 1, tag = dfa->accept[1];
+	char* p = str;
+#if USE_SHENG
+	int steps = 0;
+#endif
+
+	*mSP = str;
+	while(p < end){
+#if USE_SHENG
+		if(sheng && ++steps > SHENG_HEAD) return runSheng(dfa,s,tag,p,end,mSP,eSP);
+#endif
+		if(comb){
+			int i = dfa->comb_base[s] + cls[(unsigned char)*p];
+			s = dfa->comb_check[i] == s ? dfa->comb_next[i] : dfa->comb_def[s];
+		}
+		else s = next[s*K + cls[(unsigned char)*p]];
+		if(s == 0) break;
+		p++;
+		if(s >= dfa->accel_base) p = skipLoop(dfa,s,p,end); // 状態は変わらない
+		if(dfa->accept[s] >= 0){
+			tag = dfa->accept[s];
+			*mSP = p;
+		}
+	}
+	if(eSP) *eSP = p;
+	return tag;
+}
+
+int runDFAScalar(const LexDFA* dfa,char* str,char* end,char** mSP,char** eSP){
+	if(dfa->comb_size) return runTable(dfa,str,end,mSP,eSP,true,false);
+	return runTable(dfa,str,end,mSP,eSP,false,false);
+}
+
+static inline void runTableMulti(const LexDFA* dfa,int n,char** str,char** end,Match** m,int cap,int* count,bool comb){
+	const unsigned char* cls = dfa->cls;
+	int K = dfa->class_num;
+	int s[LEX_MULTI_MAX],tag[LEX_MULTI_MAX];
+	char *p[LEX_MULTI_MAX],*tok[LEX_MULTI_MAX],*msp[LEX_MULTI_MAX];
+	int live[LEX_MULTI_MAX]; // まだ進めている入力の番号
+	int num = 0;
+
+	for(int i=0;i<n;i++){
+		count[i] = 0;
+		s[i] = 1;
+		tag[i] = dfa->accept[1];
+		p[i] = tok[i] = msp[i] = str[i];
+		if(p[i] < end[i] && cap > 0) live[num++] = i;
+	}
+	while(num > 0){
+		for(int j=0;j<num;){
+			int i = live[j], t;
+			if(p[i] < end[i]){
+				if(comb){
+					int x = dfa->comb_base[s[i]] + cls[(unsigned char)*p[i]];
+					t = dfa->comb_check[x] == s[i] ? dfa->comb_next[x] : dfa->comb_def[s[i]];
+				}
+				else t = dfa->next[s[i]*K + cls[(unsigned char)*p[i]]];
+				if(t != 0){
+					s[i] = t;
+					p[i]++;
+					if(t >= dfa->accel_base) p[i] = skipLoop(dfa,t,p[i],end[i]);
+					if(dfa->accept[t] >= 0){
+						tag[i] = dfa->accept[t];
+						msp[i] = p[i];
+					}
+					if(comb) __builtin_prefetch(&dfa->comb_check[dfa->comb_base[t]]); // 大きい表では次の行を先読みする
+					j++;
+					continue;
+				}
+			}
+			// トークンが決まった
+			Match* mi = &m[i][count[i]++];
+			mi->str = tok[i];
+			mi->num = msp[i] - tok[i];
+			mi->tag = tag[i];
+			mi->look = p[i] - msp[i] + 1;
+			if(mi->num == 0 || msp[i] == end[i] || count[i] == cap){
+				live[j] = live[--num]; // この入力は終わり (最後の1本と入れ替える)
+				continue;
+			}
+			s[i] = 1;
+			tag[i] = dfa->accept[1];
+			p[i] = tok[i] = msp[i];
+			j++;
+		}
+	}
+}
+
+void runDFAMulti(const LexDFA* dfa,int n,char** str,char** end,Match** m,int cap,int* count){
+	if(dfa->comb_size) runTableMulti(dfa,n,str,end,m,cap,count,true);
+	else runTableMulti(dfa,n,str,end,m,cap,count,false);
+}
+
+
+int runDFA(const LexDFA* dfa,char* str,char* end,char** mSP,char** eSP){
+#if USE_SHENG
+	if(dfa->shuffle && dfa->comb_size) return runTable(dfa,str,end,mSP,eSP,true,true);
+	if(dfa->shuffle) return runTable(dfa,str,end,mSP,eSP,false,true);
+#endif
+	return runDFAScalar(dfa,str,end,mSP,eSP);
+}
@@ -0,0 +1,88 @@
+#ifndef LEX_DFA
+#define LEX_DFA
+
+#include "lex_vm.h"
+
+// 自己ループの読み飛ばしに SSSE3 を使うかどうか (実行時に SSSE3 が無ければ1文字ずつ調べる)
+#ifndef USE_SSSE3
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSSE3 1
+#else
+#define USE_SSSE3 0
+#endif
+#endif
+
+// pshufb による Sheng 方式の実行を組み込むかどうか
+// 状態数が LEX_SHENG_STATES 以下の規則でしか使えず、xcc の規則 (66 状態) では使われないので既定では外す
+// (lex_bench は USE_SHENG=1 で作った lex_dfa を使う)
+#ifndef USE_SHENG
+#define USE_SHENG 0
+#endif
+#if USE_SHENG && !USE_SSSE3
+#undef USE_SHENG
+#define USE_SHENG 0
+#endif
+
+#define LEX_DFA_MAX_STATES 65000 // これより状態が増えるなら DFA を作らず VM で実行する
+#define LEX_SHENG_STATES   16   // Sheng で扱える状態数 (xmm レジスタ1本のバイト数)
+#define LEX_ACCEL_MIN      8    // 自己ループする文字がこれ以上ある状態を SIMD で読み飛ばす
+
+#define LEX_MULTI_MAX      4    // runDFAMulti で同時に進める入力の数
+
+// 密な表がこれより大きくなるなら comb 圧縮した表を使う (入力の分を残して L2 に収まる程度)
+#ifndef LEX_DFA_DENSE_MAX
+#define LEX_DFA_DENSE_MAX (128 << 10)
+#endif
+
+typedef unsigned short dfa_state_type;
+
+// v2 形式のコードを部分集合構成法で決定化したもの
+// 状態 0 はどのスレッドも残っていない (死んだ) 状態、状態 1 が初期状態
+typedef struct LexDFA {
+	int state_num;
+	int class_num;                 // 文字クラスの数 (同じ遷移をする文字をまとめたもの)
+	unsigned char cls[256];        // 文字 -> 文字クラス
+	dfa_state_type* next;          // next[s*class_num + cls[c]] (comb のときは NULL)
+	int* accept;                   // その状態で終わったときのタグ (-1 は受理しない)
+	unsigned char (*shuffle)[16];  // Sheng 用の表 shuffle[c][s] (使えないか USE_SHENG でなければ NULL)
+	int accel_base;                // この番号以降の状態は自己ループを読み飛ばす (state_num なら無し)
+	unsigned char (*accel)[32];    // accel[s - accel_base] : 自己ループする文字の表 (truffle 形式)
+	bool accel_simd;               // 読み飛ばしに SSSE3 を使えるか
+	// comb 圧縮 (row displacement) した表 : i = comb_base[s] + k として
+	//   comb_check[i] == s なら comb_next[i]、そうでなければ comb_def[s]
+	int comb_size;                 // comb_next,comb_check の長さ (0 なら密な表を使う)
+	int* comb_base;
+	dfa_state_type* comb_def;      // 行で最も多い遷移先
+	dfa_state_type* comb_next;
+	dfa_state_type* comb_check;
+} LexDFA;
+
+
+LexDFA* buildLexDFA(const RegexVMCode* vc); // count 命令があるか状態が多すぎれば NULL
+
+struct RegexAST;
+
+// バイトコードを経由せず、規則の AST から正規表現の導関数で直接作る (状態が多すぎれば NULL)
+// asts[i] の受理のタグは tags[i]、同じ長さなら先の規則を優先する
+LexDFA* buildLexDFADeriv(struct RegexAST** asts,const int* tags,int num);
+
+void freeLexDFA(LexDFA* dfa);
+
+// runVM と同じ結果を返す (eSP には最後に読んだ文字の位置)
+int runDFA(const LexDFA* dfa,char* str,char* end,char** mSP,char** eSP);
+
+int runDFAScalar(const LexDFA* dfa,char* str,char* end,char** mSP,char** eSP); // 常に表引き
+
+// runDFAScalar と同じように進めて、到達した状態ごとに hits を数える (プロファイル用)
+void profileDFA(const LexDFA* dfa,char* str,char* end,size_t* hits);
+
+// 状態を DOT のノード d<番号> と辺で書く (hits は NULL でもよい)
+void printLexDFADot(const LexDFA* dfa,const size_t* hits,const char* (*tag_name)(int),FILE* fp);
+
+// n 本 (LEX_MULTI_MAX 以下) の入力 [str[i],end[i]) を交互に1文字ずつ進めて続けて字句解析し、
+// i 本目のマッチを m[i][0..cap) に nextMatch と同じ形で書く (count[i] にその数)
+// 入力の終わり、空マッチ、cap 個のどれかでその入力は止まる
+void runDFAMulti(const LexDFA* dfa,int n,char** str,char** end,Match** m,int cap,int* count);
+
+
+#endif // LEX_DFA
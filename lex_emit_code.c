@@ -24,8 +24,18 @@ split L1,L2      // スレッドを分割する。
 
 jmp L            // ラベルL(アドレス)にジャンプする。PC=L にセットする。
 
+splitn L1,...,Ln // split の n 分岐版 (v2 のみ)。L1 から順にスレッドを作る。
+
 match            // スレッドを終了し、成功とする。
 
+countenter k     // カウンタ k のクラスに SP が入っていれば、カウンタ値 1 で直後の count k に入る。
+                 // 下限が1以下ならその次 (ループの出口) にも進む。
+
+count k          // カウンタ k の値の集合を持つスレッド。SP がクラスに入っていれば全員の値を1増やし、
+                 // 上限未満の値があれば自分に、下限以上の値があれば次の命令に進む。
+                 // 値は (pc,値) ごとにスレッドを作らず集合で持つので、上限が大きくても
+                 // スレッド数と1文字あたりの処理は増えない。
+
 
 // AST -> codes
 
@@ -65,25 +75,51 @@ E+     || L1: codes for E
        ||   split L1,L2
        || L2:
 
+C{n,m} ||   countenter k      (C は1文字のクラス、n が 0 なら split で囲む)
+       ||   count k
+       ||
+
+E{n,m} ||   codes for E       (n 回)
+       ||   split L1,L3       (m-n 回、上限なしなら E*)
+       || L1: codes for E
+       ||   split L2,L3
+       || L2: ...
+       || L3:
+       ||                     (写しが LEX_REPEAT_EXPAND_MAX を超えるものはエラー)
+
 
 
+// v1 形式 (code)
 opcode : vm_code_type <unsigned char>
 0-3:命令用
-4,5:特になし
-6,7:clist、nlistに追加されているかどうかのフラグ
+4-7:特になし (clist、nlistに追加されているかどうかのフラグは mark に持つ)
 |7|6|5|4| 3 | 2 | 1 | 0 | 
-|c|n| | |     opcode    |
+| | | | |     opcode    |
+オペランドは opcode の直後に詰めて置く (char 2B, range 3B, any 1B, split 5B, その他 3B)
+アドレスはバイト位置
+
+// v2 形式 (code2)
+v1 を変換して作る。1命令 8バイト固定で、アドレスは命令番号
+変換後に optimizeCode2 で jmp の連鎖を飛ばし、split の連鎖を splitn にまとめる
+  (規則を束ねる split の列も先頭の splitn 1命令になる)
+| 0  | 1 | 2 |  3  | 4-5  | 6-7 |
+| op | a | b | pad | next |  x  |
+命令の読み込みが整列した1回のロードになり、次の命令も計算せずに引ける。
+スレッドリストと mark は命令番号で引く。
 
 */
 
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include "lex_parse.h"
 #include "lex_emit_code.h"
 
 
+typedef char vm_code2_size_check[sizeof(VMCode2) == 8 ? 1 : -1]; // v2 形式は 8バイト固定
+
 
 
 // AST->VMcode を実行する関数群
@@ -100,16 +136,58 @@ static vm_addr_type  code_size;
 static size_t        opcode_size;
 static size_t        code_alloced_size;
 
+static VMCounter*    counter_top;
+static int           counter_num;
+static int           counter_alloced;
+
 static void initGenCode(void){
 	code_size = 0;
 	opcode_size = 0;
 	code_alloced_size = 128;
 	code_top = (vm_code_type*)malloc(code_alloced_size*sizeof(vm_code_type));
+	counter_num = 0;
+	counter_alloced = 0;
+	counter_top = NULL;
+}
+
+// code,insn は共有して、実行用の作業領域 (スレッドリストとフラグ) だけを新しく確保する
+RegexVMCode allocVMWork(RegexVMCode vc){
+#if USE_BUF_FLAG
+	vc.buf = malloc(2*vc.opcode_size*sizeof(vm_addr_type));
+#else
+	vc.buf = NULL;
+#endif
+	vc.mark = calloc(vc.opcode_size,sizeof(vm_code_type));
+
+	// カウンタのリングバッファはまとめて1つの領域に取る
+	size_t entries = 0;
+	for(int k=0;k<vc.counter_num;k++) entries += vc.counter[k].max < 0 ? 1 : vc.counter[k].max + 1;
+	vc.count = NULL;
+	if(vc.counter_num){
+		vc.count = calloc(vc.counter_num,sizeof(VMCountSet));
+		vc.count[0].entry = malloc(entries*sizeof(int));
+		for(int k=1;k<vc.counter_num;k++){
+			int cap = vc.counter[k-1].max < 0 ? 1 : vc.counter[k-1].max + 1;
+			vc.count[k].entry = vc.count[k-1].entry + cap;
+		}
+	}
+	return vc;
+}
+
+void freeVMWork(RegexVMCode vc){
+	free(vc.buf);
+	free(vc.mark);
+	if(vc.count) free(vc.count[0].entry);
+	free(vc.count);
 }
 
 void freeVMCode(RegexVMCode vc){
 	free(vc.code);
-	free(vc.buf);
+	free(vc.code2);
+	free(vc.table);
+	free(vc.insn);
+	free(vc.counter);
+	freeVMWork(vc);
 }
 
 static vm_addr_type getCodeCount(void){ // 今までに発行した命令数、次の命令は配列の返り値番目に格納される
@@ -132,7 +210,8 @@ static inline vm_addr_type genMatch(int tag){
 }
 
 static inline void genAny(void){
-	code_top[getCodeCount()] = VM_Any;
+	vm_addr_type count = getCodeCount(); // realloc するので code_top より先に呼ぶ
+	code_top[count] = VM_Any;
 	code_size++;
 	opcode_size++;
 }
@@ -173,6 +252,26 @@ static inline vm_addr_type genJmp(vm_addr_type l){
 	return count;
 }
 
+static inline void genCount(vm_code_type op,int k){
+	vm_addr_type count = getCodeCount();
+	code_top[count] = op;
+	*(vm_addr_type*)&code_top[count+1] = (vm_addr_type)k;
+	code_size += sizeof(vm_code_type) + sizeof(vm_addr_type);
+	opcode_size++;
+}
+
+static int newCounter(const unsigned char* cls,int min,int max){
+	if(counter_num == counter_alloced){
+		counter_alloced = counter_alloced ? counter_alloced*2 : 4;
+		counter_top = realloc(counter_top,counter_alloced*sizeof(VMCounter));
+	}
+	VMCounter* ct = &counter_top[counter_num];
+	for(int i=0;i<32;i++) ct->cls[i] = cls[i];
+	ct->min = min;
+	ct->max = max;
+	return counter_num++;
+}
+
 static void patchSplitL1(vm_addr_type s,vm_addr_type l1){
 	*(vm_addr_type*)&code_top[s+1] = l1;
 }
@@ -251,7 +350,209 @@ static void convertASTtoCode(RegexAST* ast,bool state){
 			convertASTtoCode(ast->lhs,false);
 			genAny();
 			return;
+		case Repeat:{
+			unsigned char cls[32] = {0};
+			vm_addr_type ls = 0;
+			if(classOfAST(ast->lhs,cls)){ // カウンタで数える
+				int k = newCounter(cls,ast->min,ast->max);
+				if(ast->min == 0) ls = genSplit(getCodeCount() + 1 + sizeof(vm_addr_type)*2,0);
+				genCount(VM_CountEnter,k);
+				genCount(VM_Count,k);
+				if(ast->min == 0) patchSplitL2(ls,getCodeCount());
+				return;
+			}
+			// 一般の式は展開する (写しの数に比例して命令が増えるので、多すぎるものは受け付けない)
+			int copies = ast->max < 0 ? ast->min + 1 : ast->max;
+			if(copies > LEX_REPEAT_EXPAND_MAX){
+				if(ast->max < 0) printf("error Repeat. {%d,} ",ast->min);
+				else printf("error Repeat. {%d,%d} ",ast->min,ast->max);
+				printf("of a multi-char body needs %d copies (max %d)\n",copies,LEX_REPEAT_EXPAND_MAX);
+				exit(1);
+			}
+			for(int i=0;i<ast->min;i++) convertASTtoCode(ast->lhs,true);
+			if(ast->max < 0){
+				RegexAST star = { .type = Star, .lhs = ast->lhs };
+				convertASTtoCode(&star,true);
+				return;
+			}
+			vm_addr_type* splits = malloc(sizeof(vm_addr_type)*(ast->max - ast->min + 1));
+			for(int i=0;i<ast->max - ast->min;i++){
+				splits[i] = genSplit(0,0);
+				patchSplitL1(splits[i],getCodeCount());
+				convertASTtoCode(ast->lhs,true);
+			}
+			for(int i=0;i<ast->max - ast->min;i++) patchSplitL2(splits[i],getCodeCount());
+			free(splits);
+			return;
+		}
+	}
+}
+
+// v1 の命令の長さ
+static size_t codeLength(vm_code_type op){
+	switch(op){
+		case VM_Char: case VM_NotChar:   return 1 + sizeof(char_type);
+		case VM_Range: case VM_NotRange: return 1 + sizeof(char_type)*2;
+		case VM_Any:                     return 1;
+		case VM_Split:                   return 1 + sizeof(vm_addr_type)*2;
+		default:                         return 1 + sizeof(vm_addr_type); // jmp,match,countenter,count
+	}
+}
+
+// v1 -> v2
+static VMCode2* convertCode2(const vm_code_type* code,size_t code_size,size_t opcode_size){
+	vm_addr_type* index = malloc(sizeof(vm_addr_type)*(code_size + 1)); // バイト位置 -> 命令番号
+	VMCode2* code2 = calloc(opcode_size,sizeof(VMCode2));
+	size_t n = 0;
+
+	for(size_t PC = 0;PC < code_size;PC += codeLength(code[PC])) index[PC] = n++;
+	index[code_size] = n;
+
+	n = 0;
+	for(size_t PC = 0;PC < code_size;PC += codeLength(code[PC]),n++){
+		VMCode2* c2 = &code2[n];
+		const char_type* ch = (const char_type*)&code[PC+1];
+		const vm_addr_type* addr = (const vm_addr_type*)&code[PC+1];
+		c2->op = code[PC];
+		c2->next = index[PC + codeLength(code[PC])];
+		switch(c2->op){
+			case VM_Char: case VM_NotChar:   c2->a = ch[0]; break;
+			case VM_Range: case VM_NotRange: c2->a = ch[0]; c2->b = ch[1]; break;
+			case VM_Split: c2->next = index[addr[0]]; c2->x = index[addr[1]]; break;
+			case VM_Jmp:   c2->next = index[addr[0]]; break;
+			case VM_Match: case VM_CountEnter: case VM_Count: c2->x = addr[0]; break;
+		}
+	}
+
+	free(index);
+	return code2;
+}
+
+#define IS_EPS(op) ((op) == VM_Split || (op) == VM_Jmp)
+
+// pc から split,jmp だけを辿って着く命令を out に L1 優先の深さ優先順で返す
+static size_t epsClosure(const VMCode2* code,vm_addr_type pc,vm_addr_type* out,
+                         vm_addr_type* stack,vm_addr_type* visit,unsigned char* seen){
+	size_t sp = 0,n = 0,nv = 0;
+	stack[sp++] = pc;
+	while(sp){
+		vm_addr_type p = stack[--sp];
+		if(seen[p]) continue;
+		seen[p] = 1;
+		visit[nv++] = p;
+		switch(code[p].op){
+			case VM_Split: stack[sp++] = code[p].x; stack[sp++] = code[p].next; break; // L1 を先に辿る
+			case VM_Jmp:   stack[sp++] = code[p].next; break;
+			default:       out[n++] = p; break;
+		}
+	}
+	while(nv) seen[visit[--nv]] = 0;
+	return n;
+}
+
+// v2 の最適化 (ε 遷移の連鎖を1命令にまとめる)
+//   文字を読む命令,notchar,count の next と先頭の命令について、split,jmp だけで着く命令を調べて
+//     1つなら参照をその命令に付け替える (jmp の連鎖が消える)
+//     2つなら split、3つ以上なら splitn にする (飛び先の順は元の split の優先順)
+//   最後に辿り着けなくなった命令を詰める。番号は元の順に振り直すので、match の優先順位は変わらない
+static void optimizeCode2(RegexVMCode* vc){
+	size_t n = vc->opcode_size;
+	VMCode2* code = vc->code2;
+	VMCode2* orig = malloc(sizeof(VMCode2)*n); // 閉包は元の命令列で調べる
+	vm_addr_type* ref = malloc(sizeof(vm_addr_type)*n); // ε 命令への参照の付け替え先
+	unsigned char* done = calloc(n,1);
+	unsigned char* seen = calloc(n,1);
+	vm_addr_type* stack = malloc(sizeof(vm_addr_type)*(2*n + 1));
+	vm_addr_type* visit = malloc(sizeof(vm_addr_type)*n);
+	vm_addr_type* out = malloc(sizeof(vm_addr_type)*n);
+	vm_addr_type* table = NULL;
+	size_t table_size = 0,table_alloced = 0;
+	size_t k,m;
+
+	memcpy(orig,code,sizeof(VMCode2)*n);
+
+	for(k = 0;k <= n;k++){
+		vm_addr_type* e; // 付け替える参照 (k == n は先頭の命令)
+		if(k == n) e = NULL;
+		else if(IS_EPS(orig[k].op) || orig[k].op == VM_Match || orig[k].op == VM_CountEnter) continue;
+		else e = &code[k].next;
+
+		vm_addr_type p = e ? *e : 0;
+		if(!IS_EPS(orig[p].op)) continue;
+		if(!done[p]){
+			done[p] = 1;
+			ref[p] = p;
+			size_t c = epsClosure(orig,p,out,stack,visit,seen);
+			if(c == 1){
+				code[p].op = VM_Jmp;
+				code[p].next = ref[p] = out[0];
+			}
+			else if(c == 2){
+				code[p].op = VM_Split;
+				code[p].next = out[0];
+				code[p].x = out[1];
+			}
+			else if(c > 2 && table_size + c <= 0xffff){ // c == 0 (抜けられないループ) と表があふれたときはそのまま
+				if(table_size + c > table_alloced){
+					table_alloced = (table_size + c)*2;
+					table = realloc(table,sizeof(vm_addr_type)*table_alloced);
+				}
+				code[p].op = VM_SplitN;
+				code[p].next = table_size;
+				code[p].x = c;
+				memcpy(&table[table_size],out,sizeof(vm_addr_type)*c);
+				table_size += c;
+			}
+		}
+		if(e) *e = ref[p];
+	}
+
+	// 先頭から辿れる命令に印を付ける
+	vm_addr_type* index = ref; // 古い番号 -> 新しい番号
+	size_t sp = 0;
+	stack[sp++] = 0;
+	seen[0] = 1;
+#define REACH(pc) { vm_addr_type r_ = (pc); if(!seen[r_]){ seen[r_] = 1; stack[sp++] = r_; } }
+	while(sp){
+		const VMCode2* c2 = &code[stack[--sp]];
+		switch(c2->op){
+			case VM_Match:  break;
+			case VM_Split:  REACH(c2->next); REACH(c2->x); break;
+			case VM_SplitN: for(int j=0;j<c2->x;j++) REACH(table[c2->next + j]); break;
+			default:        REACH(c2->next); break;
+		}
+	}
+#undef REACH
+
+	m = 0;
+	for(k = 0;k < n;k++) if(seen[k]) index[k] = m++;
+
+	VMCode2* code2 = calloc(m,sizeof(VMCode2));
+	vm_addr_type* table2 = table_size ? malloc(sizeof(vm_addr_type)*table_size) : NULL;
+	size_t t = 0;
+	for(k = 0;k < n;k++){
+		if(!seen[k]) continue;
+		VMCode2* c2 = &code2[index[k]];
+		*c2 = code[k];
+		switch(c2->op){
+			case VM_Match:  break;
+			case VM_Split:  c2->next = index[c2->next]; c2->x = index[c2->x]; break;
+			case VM_SplitN:
+				for(int j=0;j<c2->x;j++) table2[t + j] = index[table[c2->next + j]];
+				c2->next = t;
+				t += c2->x;
+				break;
+			default:        c2->next = index[c2->next]; break;
+		}
 	}
+
+	free(orig); free(ref); free(done); free(seen);
+	free(stack); free(visit); free(out); free(table);
+	free(code);
+
+	vc->code2 = code2;
+	vc->opcode_size = m;
+	vc->table = table2;
 }
 
 RegexVMCode emitVMCode(RegexAST** ast,SymbolElement* el,int n){
@@ -277,19 +578,18 @@ RegexVMCode emitVMCode(RegexAST** ast,SymbolElement* el,int n){
 	//printf("reallocated! %lubytes + %lubytes = %lubytes.\n",code_size*sizeof(vm_code_type),2*opcode_size*sizeof(vm_addr_type),code_size*sizeof(vm_code_type)+2*opcode_size*sizeof(vm_addr_type));
 
 
-#if USE_BUF_FLAG
-	vm_addr_type* buf = malloc(2*opcode_size*sizeof(vm_addr_type));
-#else
-	vm_addr_type* buf = NULL;
-#endif	
-
-	RegexVMCode vc={code_size,opcode_size,code_top,buf};
-	return vc;
+	RegexVMCode vc={code_size,opcode_size,code_top,NULL,NULL,NULL,NULL,NULL,counter_num,counter_top,NULL};
+	vc.code2 = convertCode2(code_top,code_size,opcode_size);
+	optimizeCode2(&vc);
+#if USE_THREADED
+	buildThreadedCode(&vc);
+#endif
+	return allocVMWork(vc);
 }
 
 
-void printVMCode(RegexVMCode vc){
-	printf("code_size : %zu , opcode_size : %zu \n",vc.code_size,vc.opcode_size);
+static void printCode1(RegexVMCode vc){
+	printf("v1 : code_size : %zu \n",vc.code_size);
 	vm_code_type* code = vc.code;
 	for(vm_addr_type PC = 0;PC < vc.code_size;){
 		printf("%04d : ",PC);
@@ -326,6 +626,14 @@ void printVMCode(RegexVMCode vc){
 				printf("match %d",*(vm_addr_type*)&code[PC+1]);
 				PC += 1 + sizeof(vm_addr_type);
 				break;
+			case VM_CountEnter:
+			case VM_Count:{
+				VMCounter* ct = &vc.counter[*(vm_addr_type*)&code[PC+1]];
+				printf("%s %d {%d,%d}",code[PC] == VM_Count ? "count" : "countenter",
+						*(vm_addr_type*)&code[PC+1],ct->min,ct->max);
+				PC += 1 + sizeof(vm_addr_type);
+				break;
+			}
 			default:
 				printf("!!!unknown opecode!!! code[PC] = 0x%x",code[PC]);
 				goto L;
@@ -339,5 +647,122 @@ L:
 	return;
 }
 
+static void printCode2(RegexVMCode vc){
+	printf("v2 : %zu insns , %zu bytes \n",vc.opcode_size,vc.opcode_size*sizeof(VMCode2));
+	for(size_t n = 0;n < vc.opcode_size;n++){
+		const VMCode2* c2 = &vc.code2[n];
+		printf("%04zu : ",n);
+		switch(c2->op){
+			case VM_Char:     printf("char %c",c2->a); break;
+			case VM_Range:    printf("range %c , %c",c2->a,c2->b); break;
+			case VM_Any:      printf("any ."); break;
+			case VM_NotChar:  printf("not char %c",c2->a); break;
+			case VM_NotRange: printf("not range %c , %c",c2->a,c2->b); break;
+			case VM_Split:    printf("split %04d , %04d",c2->next,c2->x); break;
+			case VM_Jmp:      printf("jmp %04d",c2->next); break;
+			case VM_Match:    printf("match %d",c2->x); break;
+			case VM_SplitN:
+				printf("splitn");
+				for(int j=0;j<c2->x;j++) printf("%s%04d",j ? " , " : " ",vc.table[c2->next + j]);
+				break;
+			case VM_CountEnter:
+			case VM_Count:
+				printf("%s %d {%d,%d}",c2->op == VM_Count ? "count" : "countenter",
+						c2->x,vc.counter[c2->x].min,vc.counter[c2->x].max);
+				break;
+			default:
+				printf("!!!unknown opecode!!! op = 0x%x\n",c2->op);
+				printf("print Error!\n");
+				return;
+		}
+		if(c2->op != VM_Split && c2->op != VM_SplitN && c2->op != VM_Jmp && c2->op != VM_Match) printf("  -> %04d",c2->next);
+		printf("\n");
+	}
+}
+
+// v1,v2 の両方を表示する
+void printVMCode(RegexVMCode vc){
+	printCode1(vc);
+	if(vc.code2) printCode2(vc);
+}
+
 
+// 0 回は白、最大回数は赤になるように、回数の対数で彩度を決める
+void printDotHeat(FILE* fp,size_t h,size_t max){
+	double lh = 0,lm = 0;
+	int k;
+	for(k = 0;((h + 1) >> k) > 1;k++) ;
+	lh = k + (double)(h + 1)/((size_t)1 << k) - 1; // log2(h+1) の折れ線近似
+	for(k = 0;((max + 1) >> k) > 1;k++) ;
+	lm = k + (double)(max + 1)/((size_t)1 << k) - 1;
+	fprintf(fp,"fillcolor = \"0.000 %.3f 1.000\"",lm > 0 ? lh/lm : 0.0);
+}
+
+void printDotChar(FILE* fp,char_type c){
+	unsigned char u = (unsigned char)c;
+	if(c == '"' || c == '\\') fprintf(fp,"\\%c",c);
+	else if(u > ' ' && u < 0x7f) fputc(c,fp);
+	else fprintf(fp,"\\\\x%02x",u);
+}
+
+void printVMCodeDot(RegexVMCode vc,const size_t* hits,const char* (*tag_name)(int),FILE* fp){
+	size_t max = 0;
+	if(hits) for(size_t n = 0;n < vc.opcode_size;n++) if(hits[n] > max) max = hits[n];
+
+	for(size_t n = 0;n < vc.opcode_size;n++){
+		const VMCode2* c2 = &vc.code2[n];
+		fprintf(fp,"        n%zu [label = \"%04zu : ",n,n);
+		switch(c2->op){
+			case VM_Char:     fprintf(fp,"char "); printDotChar(fp,c2->a); break;
+			case VM_NotChar:  fprintf(fp,"not char "); printDotChar(fp,c2->a); break;
+			case VM_Range:
+			case VM_NotRange:
+				fprintf(fp,"%srange ",c2->op == VM_NotRange ? "not " : "");
+				printDotChar(fp,c2->a); fprintf(fp,"-"); printDotChar(fp,c2->b);
+				break;
+			case VM_Any:      fprintf(fp,"any"); break;
+			case VM_Split:    fprintf(fp,"split"); break;
+			case VM_SplitN:   fprintf(fp,"splitn %d",c2->x); break;
+			case VM_Jmp:      fprintf(fp,"jmp"); break;
+			case VM_Match:
+				if(tag_name) fprintf(fp,"match %s",tag_name(c2->x));
+				else fprintf(fp,"match %d",c2->x);
+				break;
+			case VM_CountEnter:
+			case VM_Count:
+				fprintf(fp,"%s %d {%d,%d}",c2->op == VM_Count ? "count" : "countenter",
+						c2->x,vc.counter[c2->x].min,vc.counter[c2->x].max);
+				break;
+		}
+		if(hits) fprintf(fp,"\\n%zu",hits[n]);
+		fprintf(fp,"\"%s",n == 0 ? ", penwidth = 2" : "");
+		if(hits){ fprintf(fp,", "); printDotHeat(fp,hits[n],max); }
+		fprintf(fp,"];\n");
+	}
 
+	// 文字を読む辺は実線、ε 辺は破線 (split の飛び先には優先順の番号を付ける)
+	for(size_t n = 0;n < vc.opcode_size;n++){
+		const VMCode2* c2 = &vc.code2[n];
+		switch(c2->op){
+			case VM_Match: break;
+			case VM_Split:
+				fprintf(fp,"        n%zu -> n%d [style = dashed, label = \"1\"];\n",n,c2->next);
+				fprintf(fp,"        n%zu -> n%d [style = dashed, label = \"2\"];\n",n,c2->x);
+				break;
+			case VM_SplitN:
+				for(int j = 0;j < c2->x;j++)
+					fprintf(fp,"        n%zu -> n%d [style = dashed, label = \"%d\"];\n",n,vc.table[c2->next + j],j + 1);
+				break;
+			case VM_Jmp:
+			case VM_NotChar:
+			case VM_NotRange:
+				fprintf(fp,"        n%zu -> n%d [style = dashed];\n",n,c2->next);
+				break;
+			case VM_Count:
+				fprintf(fp,"        n%zu -> n%zu;\n",n,n); // fall through
+			default:
+				fprintf(fp,"        n%zu -> n%d;\n",n,c2->next);
+				break;
+		}
+	}
+}
@@ -13,6 +13,9 @@
 #define VM_NotRange 5
 #define VM_Split    6
 #define VM_Jmp      7
+#define VM_CountEnter 8
+#define VM_Count      9
+#define VM_SplitN    10 // v2 のみ (optimizeCode2 が split の連鎖から作る)
 
 /*
 const vm_code_type VM_Match    = 0;
@@ -32,9 +35,20 @@ struct RegexAST;
 
 RegexVMCode emitVMCode(RegexAST** ast,SymbolElement* el,int num);
 
+RegexVMCode allocVMWork(RegexVMCode vc);
+
+void freeVMWork(RegexVMCode vc);
+
 void freeVMCode(RegexVMCode vc);
 
 void printVMCode(RegexVMCode vc);
 
+// v2 の命令を DOT のノード n<番号> と辺で書く (hits は NULL でもよい)
+void printVMCodeDot(RegexVMCode vc,const size_t* hits,const char* (*tag_name)(int),FILE* fp);
+
+void printDotHeat(FILE* fp,size_t h,size_t max); // 実行回数に応じた fillcolor
+
+void printDotChar(FILE* fp,char_type c); // DOT のラベルの中に1文字書く
+
 
 #endif // VM_EMIT_CODE
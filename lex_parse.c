@@ -13,8 +13,12 @@ primary ::= character
          |  character '*'
          |  character '+'
          |  character '?'
+         |  character '{' bound '}'
          ;
 
+bound ::= digits | digits ',' | digits ',' digits ;  // {n} {n,} {n,m}
+                                                      // bound にならない '{' は文字として扱う
+
 character ::= '['  char-class ']'
            |  '[^' char-class ']'
            |  '[:' posix-class ':]'
@@ -92,6 +96,21 @@ static inline RegexAST* makeRange(char_type b,char_type e){
 	return ret;
 }
 
+// lhs{min,max} 、特別な場合は今までの演算子に直す
+static RegexAST* makeRepeat(RegexAST* lhs,int min,int max){
+	if(min == 0 && max < 0)  return makeAST(Star,lhs,NULL);
+	if(min == 1 && max < 0)  return makeAST(Plus,lhs,NULL);
+	if(min == 0 && max == 1) return makeAST(Question,lhs,NULL);
+	if(min == 1 && max == 1) return lhs;
+	if(max == 0){
+		freeAST(lhs);
+		return NULL;
+	}
+	RegexAST* ret = makeAST(Repeat,lhs,NULL);
+	ret->min = min; ret->max = max;
+	return ret;
+}
+
 void freeAST(RegexAST* ast){
 	if(ast == NULL || ast->type == Dot) return;
 	switch(ast->type){
@@ -103,6 +122,7 @@ void freeAST(RegexAST* ast){
 		case Or:      freeAST(ast->lhs);
 					  freeAST(ast->rhs); break;
 		case Not:     freeAST(ast->lhs); break;
+		case Repeat:  freeAST(ast->lhs); break;
 		default: break;
 	}
 
@@ -137,6 +157,9 @@ void printAST(RegexAST* ast,int indent){
 		case Char:    printf("%*sChar : %c\n",indent,"",ast->c); break;
 		case Dot:     printf("%*sDot\n",indent,"");     break;
 		case Range:   printf("%*sRange: %c - %c\n",indent,"",ast->begin,ast->end); break;
+		case Repeat:  printf("%*sRepeat{%d,%d}{\n",indent,"",ast->min,ast->max); 
+					  printAST(ast->lhs,indent+1);
+					  printf("%*s}\n",indent,"");       break;
 		default:
 			printf("ERROR\n");
 	}
@@ -147,6 +170,161 @@ void printAST(RegexAST* ast,int indent){
 
 
 
+// ast が1文字だけ読むクラスなら、受理する文字のビット表を cls に作って true を返す
+bool classOfAST(RegexAST* ast,unsigned char* cls){
+	unsigned char sub[32];
+	if(ast == NULL) return false;
+	switch(ast->type){
+		case Char:
+			cls[(unsigned char)ast->c >> 3] |= 1 << ((unsigned char)ast->c & 7);
+			return true;
+		case Range: // VM と同じく char_type の大小で比べる
+			for(int c = ast->begin;c <= ast->end;c++) cls[(unsigned char)c >> 3] |= 1 << ((unsigned char)c & 7);
+			return true;
+		case Dot:
+			for(int i=0;i<32;i++) cls[i] = 0xff;
+			return true;
+		case Or:
+			return classOfAST(ast->lhs,cls) && classOfAST(ast->rhs,cls);
+		case Not:
+			for(int i=0;i<32;i++) sub[i] = 0;
+			if(!classOfAST(ast->lhs,sub)) return false;
+			for(int i=0;i<32;i++) cls[i] |= ~sub[i];
+			return true;
+		default:
+			return false;
+	}
+}
+
+// 文字列の解析 (findMatch の前処理用)
+
+static void litSet(LexLiteral* l,const char_type* s,int len,bool keep_tail){
+	if(len > LEX_LIT_MAX){
+		if(keep_tail) s += len - LEX_LIT_MAX;
+		len = LEX_LIT_MAX;
+	}
+	for(int i=0;i<len;i++) l->str[i] = s[i];
+	l->len = len;
+}
+
+static void litCat(LexLiteral* dst,const LexLiteral* a,const LexLiteral* b,bool keep_tail){
+	char_type buf[LEX_LIT_MAX*2];
+	for(int i=0;i<a->len;i++) buf[i] = a->str[i];
+	for(int i=0;i<b->len;i++) buf[a->len+i] = b->str[i];
+	litSet(dst,buf,a->len + b->len,keep_tail);
+}
+
+static bool litEqual(const LexLiteral* a,const LexLiteral* b){
+	if(a->len != b->len) return false;
+	for(int i=0;i<a->len;i++) if(a->str[i] != b->str[i]) return false;
+	return true;
+}
+
+// 長い方、同じ長さなら位置の上限が小さい方
+static void litBetter(LexLiteral* req,int* off,const LexLiteral* l,int l_off){
+	if(l->len > req->len || (l->len == req->len && l->len && l_off >= 0 && (*off < 0 || l_off < *off))){
+		*req = *l;
+		*off = l_off;
+	}
+}
+
+static int addLen(int a,int b){ return a < 0 || b < 0 ? -1 : a + b; }
+
+void analyzeAST(RegexAST* ast,RegexInfo* info){
+	RegexInfo l,r;
+	int i;
+	for(i=0;i<32;i++) info->first[i] = 0;
+	info->nullable = false;
+	info->maxlen = 0;
+	info->exact = false;
+	info->pre.len = info->suf.len = info->req.len = 0;
+	info->req_off = 0;
+
+	if(ast == NULL){ // 空文字列
+		info->nullable = true;
+		info->exact = true;
+		return;
+	}
+
+	switch(ast->type){
+		case Char:
+			classOfAST(ast,info->first);
+			info->maxlen = 1;
+			info->exact = true;
+			litSet(&info->pre,&ast->c,1,false);
+			info->suf = info->req = info->pre;
+			return;
+		case Range: case Dot: case Not:
+			classOfAST(ast,info->first);
+			info->maxlen = 1;
+			return;
+		case Connect:
+			analyzeAST(ast->lhs,&l);
+			analyzeAST(ast->rhs,&r);
+			for(i=0;i<32;i++) info->first[i] = l.first[i] | (l.nullable ? r.first[i] : 0);
+			info->nullable = l.nullable && r.nullable;
+			info->maxlen = addLen(l.maxlen,r.maxlen);
+			info->exact = l.exact && r.exact && l.pre.len + r.pre.len <= LEX_LIT_MAX;
+			if(l.exact) litCat(&info->pre,&l.pre,&r.pre,false);
+			else info->pre = l.pre;
+			if(r.exact) litCat(&info->suf,&l.suf,&r.suf,true);
+			else info->suf = r.suf;
+			{
+				LexLiteral mid;
+				litCat(&mid,&l.suf,&r.pre,false);
+				info->req = l.req; info->req_off = l.req_off;
+				litBetter(&info->req,&info->req_off,&r.req,addLen(l.maxlen,r.req_off));
+				litBetter(&info->req,&info->req_off,&mid,l.maxlen < 0 ? -1 : l.maxlen - l.suf.len);
+				litBetter(&info->req,&info->req_off,&info->pre,0);
+			}
+			return;
+		case Or:
+			analyzeAST(ast->lhs,&l);
+			analyzeAST(ast->rhs,&r);
+			for(i=0;i<32;i++) info->first[i] = l.first[i] | r.first[i];
+			info->nullable = l.nullable || r.nullable;
+			info->maxlen = l.maxlen < 0 || r.maxlen < 0 ? -1 : (l.maxlen > r.maxlen ? l.maxlen : r.maxlen);
+			info->exact = l.exact && r.exact && litEqual(&l.pre,&r.pre);
+			for(i=0;i<l.pre.len && i<r.pre.len && l.pre.str[i] == r.pre.str[i];i++) ;
+			litSet(&info->pre,l.pre.str,i,false);
+			for(i=0;i<l.suf.len && i<r.suf.len && l.suf.str[l.suf.len-1-i] == r.suf.str[r.suf.len-1-i];i++) ;
+			litSet(&info->suf,l.suf.str + l.suf.len - i,i,true);
+			if(litEqual(&l.req,&r.req)){
+				info->req = l.req;
+				info->req_off = l.req_off < 0 || r.req_off < 0 ? -1 : (l.req_off > r.req_off ? l.req_off : r.req_off);
+			}
+			litBetter(&info->req,&info->req_off,&info->pre,0);
+			return;
+		case Star: case Question:
+			analyzeAST(ast->lhs,&l);
+			for(i=0;i<32;i++) info->first[i] = l.first[i];
+			info->nullable = true;
+			info->maxlen = ast->type == Star ? -1 : l.maxlen;
+			return;
+		case Plus: case Repeat:
+			analyzeAST(ast->lhs,&l);
+			*info = l;
+			info->exact = false;
+			if(ast->type == Plus || ast->max < 0) info->maxlen = -1;
+			else if(l.maxlen >= 0) info->maxlen = l.maxlen * ast->max;
+			if(ast->type == Repeat && ast->min == 0){ // 0回でもよいので文字列は残らない
+				info->nullable = true;
+				info->pre.len = info->suf.len = info->req.len = 0;
+				info->req_off = 0;
+			}
+			else if(ast->type == Repeat && l.exact && ast->min == ast->max && l.pre.len * ast->min <= LEX_LIT_MAX){
+				for(i=1;i<ast->min;i++) litCat(&info->pre,&info->pre,&l.pre,false);
+				info->suf = info->req = info->pre;
+				info->req_off = 0;
+				info->exact = true;
+			}
+			return;
+	}
+}
+
+
+
+
 //字句解析関数
 
 void setLex(char_type** str){
@@ -313,12 +491,45 @@ static RegexAST* parseCharacter(void){
 }
 
 
+static int parseNumber(int k,int* n){ // k 文字目から数字を読んで、読んだ文字数を返す
+	int i = 0;
+	*n = 0;
+	while(isdigit((unsigned char)lookToken(k+i))){
+		if(*n <= LEX_REPEAT_MAX) *n = *n * 10 + (lookToken(k+i) - '0');
+		i++;
+	}
+	return i;
+}
+
+// '{' bound '}' なら読んで true を返す、そうでなければ何も読まない
+static bool parseBound(int* min,int* max){
+	int k = 2, i;
+	if(lookToken(1) != '{') return false;
+	if((i = parseNumber(k,min)) == 0) return false;
+	k += i;
+	*max = *min;
+	if(lookToken(k) == ','){
+		k++;
+		if((i = parseNumber(k,max)) == 0) *max = -1;
+		k += i;
+	}
+	if(lookToken(k) != '}') return false;
+	if(*min > LEX_REPEAT_MAX || *max > LEX_REPEAT_MAX || (*max >= 0 && *max < *min)){
+		// error
+		printf("error parseBound. {%d,%d}\n",*min,*max); exit(1);
+	}
+	while(k--) consumeToken();
+	return true;
+}
+
 static RegexAST* parsePrimary(void){
 	RegexAST* ch = parseCharacter();
+	int min,max;
 	switch(lookToken(1)){
 		case '*': consumeToken(); ch = makeAST(Star,ch,NULL); break;
 		case '+': consumeToken(); ch = makeAST(Plus,ch,NULL); break;
 		case '?': consumeToken(); ch = makeAST(Question,ch,NULL); break;
+		case '{': if(parseBound(&min,&max)) ch = makeRepeat(ch,min,max); break;
 	}
 
 	return ch;
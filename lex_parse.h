@@ -12,7 +12,8 @@ enum ASTType{
 	Not,
 	Char,
 	Dot,
-	Range
+	Range,
+	Repeat
 };
 
 #ifdef CC_OLD
@@ -22,6 +23,7 @@ typedef struct RegexAST{
 	struct RegexAST* rhs;
 	char_type c;
 	char_type begin,end;
+	int min,max; // Repeat : lhs{min,max} (max < 0 は上限なし)
 } RegexAST;
 #else
 typedef struct RegexAST{
@@ -36,12 +38,30 @@ typedef struct RegexAST{
 			char_type begin,end;
 		};
 	};
+	int min,max; // Repeat : lhs{min,max} (max < 0 は上限なし)
 } RegexAST;
 #endif
 
 
+// findMatch の前処理のための解析結果
+typedef struct {
+	bool nullable;         // 空文字列にマッチする
+	unsigned char first[32]; // マッチの先頭になりうる文字 (nullable のときは意味がない)
+	int maxlen;            // マッチの長さの上限 (-1 は上限なし)
+	bool exact;            // pre がマッチする唯一の文字列
+	LexLiteral pre;        // すべてのマッチの先頭にある文字列
+	LexLiteral suf;        // すべてのマッチの末尾にある文字列
+	LexLiteral req;        // すべてのマッチに含まれる文字列
+	int req_off;           // マッチの先頭から req までの距離の上限 (-1 は上限なし)
+} RegexInfo;
+
+
 void printAST(RegexAST* ast,int indent);
 
+bool classOfAST(RegexAST* ast,unsigned char* cls); // 1文字だけ読むクラスなら cls に受理する文字を足す
+
+void analyzeAST(RegexAST* ast,RegexInfo* info);
+
 void setLex(char_type** str);
 
 RegexAST* parseRegex(char_type** str);
@@ -1,36 +1,77 @@
-
+#define _GNU_SOURCE // memmem
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "lex_parse.h"
 #include "lex_emit_code.h"
 #include "lex_vm.h"
+#include "lex_dfa.h"
 
 
 
-#define opcode_mask 0x0f
 #define nlist_mask  0x40
 #define clist_mask  0x80
 
-#define OPCODE(pc)        (code[pc] & opcode_mask)
-#define CHAR(pc,offset)   (*((char*)&code[pc+1] + offset))
-#define ADDR(pc,offset)   (*((vm_addr_type*)&code[pc+1] + offset))
-
 #define swap(type,a,b) { type t = a; a = b; b = t; }
 
+#define IN_CLASS(ct,c) (((ct)->cls[(unsigned char)(c) >> 3] >> ((unsigned char)(c) & 7)) & 1)
+
+static inline void resetCounters(RegexVMCode* vc){
+	for(int k=0;k<vc->counter_num;k++){
+		vc->count[k].head = vc->count[k].len = 0;
+		vc->count[k].step = -1;
+	}
+}
+
+// 位置 s の文字でカウンタ値 1 のスレッドを加える (countenter)
+static inline void countEnter(VMCountSet* cs,const VMCounter* ct,int s){
+	if(cs->step < s) cs->len = 0; // 直前の位置で count 命令にスレッドがいなかった
+	cs->step = s + 1;
+	if(ct->max < 0 && cs->len) return; // 上限なしなら最も古い (大きい) 値だけあればよい
+	int cap = ct->max < 0 ? 1 : ct->max + 1;
+	cs->entry[(cs->head + cs->len) % cap] = s;
+	cs->len++;
+}
+
+// 位置 s の文字を読んで全員の値を1増やす (count)
+// ループを続けられる値があれば 1、出口に進める値があれば 2 のビットを返す
+static inline int countStep(VMCountSet* cs,const VMCounter* ct,int s){
+	int cap = ct->max < 0 ? 1 : ct->max + 1;
+	int ret = 0;
+	if(ct->max >= 0){
+		while(cs->len && s + 1 - cs->entry[cs->head] > ct->max){
+			cs->head = (cs->head + 1) % cap;
+			cs->len--;
+		}
+	}
+	if(cs->len == 0) return 0;
+	cs->step = s + 1;
+	if(s + 1 - cs->entry[cs->head] >= ct->min) ret |= 2;
+	if(ct->max < 0 || s + 1 - cs->entry[(cs->head + cs->len - 1) % cap] < ct->max) ret |= 1;
+	return ret;
+}
+
 #define addthread(list,c,pc) {       \
-	if( !(code[pc] & list##_mask) ){ \
+	if( !(mark[pc] & list##_mask) ){ \
 		list[c++] = pc;              \
-		code[pc] |= list##_mask;     \
+		mark[pc] |= list##_mask;     \
 	}                                \
 }
 
-int topMatch(RegexVMCode vc,char* str,char** mSP){ // 先頭マッチによりマッチした文字列の直後のポインタを返す
+// 先頭マッチによりマッチした文字列の直後のポインタを返す
+// v2 形式 (code2) を実行するので、スレッドリストと mark は命令番号で引く
+// 入力は [str,end) で、終端文字は使わない (end は読まない)
+// eSP には最後に読んだ文字の位置を返す (NULL なら返さない)
+// st が NULL の呼び出しはインライン展開で計測コードが消える
+static inline int runVM(RegexVMCode vc,char* str,char* end,char** mSP,char** eSP,VMStats* st){
 	char* SP = str;
 	*mSP = SP;
 	vm_addr_type mPC = 0xffff;
 	int tag = -1;
 	vm_addr_type PC = 0;
-	vm_code_type* code = vc.code;
+	const VMCode2* code = vc.code2;
+	const VMCode2* ins;
+	vm_code_type* mark = vc.mark; // code は書き換えないので複数の Lexer で共有できる
 	
 	int nc = 0 , cc = 0 ;
 
@@ -42,43 +83,79 @@ int topMatch(RegexVMCode vc,char* str,char** mSP){ // 先頭マッチにより
 	vm_addr_type* clist = (vm_addr_type*)malloc(sizeof(vm_addr_type)*vc.opcode_size);
 #endif
 
+#if LEX_STATS
+	if(st) st->calls++;
+#endif
+
+	resetCounters(&vc);
 	addthread(clist,cc,0);
 	for(;;){
+		bool eof = (SP == end); // 終端では文字を読む命令はすべて失敗する
 		for(int i = 0;i < cc;i++){
 			PC = clist[i];
-			switch(OPCODE(PC)){
+			ins = &code[PC];
+#if LEX_STATS
+			if(st){
+				st->dispatch[ins->op]++;
+				if(st->hits) st->hits[PC]++;
+			}
+#endif
+			switch(ins->op){
 			case VM_Char:
-				if(*SP != CHAR(PC,0)) break;
-				addthread(nlist,nc,PC+2);
+				if(eof || *SP != ins->a) break;
+				addthread(nlist,nc,ins->next);
 				break;
 			case VM_Range:
-				if( ! ( CHAR(PC,0) <= *SP && *SP <= CHAR(PC,1) ) ) break;
-				addthread(nlist,nc,PC+3);
+				if(eof || ! ( ins->a <= *SP && *SP <= ins->b ) ) break;
+				addthread(nlist,nc,ins->next);
 				break;
 			case VM_Any:
-				addthread(nlist,nc,PC+1);
+				if(eof) break;
+				addthread(nlist,nc,ins->next);
 				break;
 			case VM_NotChar:
-				if(*SP == CHAR(PC,0)) break;
-				addthread(clist,cc,PC+2);
+				if(eof || *SP == ins->a) break;
+				addthread(clist,cc,ins->next);
 				break;
 			case VM_NotRange:
-				if( CHAR(PC,0) <= *SP && *SP <= CHAR(PC,1) ) break;
-				addthread(clist,cc,PC+3);
+				if(eof || ( ins->a <= *SP && *SP <= ins->b ) ) break;
+				addthread(clist,cc,ins->next);
 				break;
 			case VM_Split:
-				addthread(clist,cc,ADDR(PC,0));
-				addthread(clist,cc,ADDR(PC,1));
+				addthread(clist,cc,ins->next);
+				addthread(clist,cc,ins->x);
 				break;
 			case VM_Jmp:
-				addthread(clist,cc,ADDR(PC,0));
+				addthread(clist,cc,ins->next);
+				break;
+			case VM_SplitN:{
+				const vm_addr_type* t = &vc.table[ins->next];
+				for(int j = 0;j < ins->x;j++) addthread(clist,cc,t[j]);
+				break;
+			}
+			case VM_CountEnter:{
+				const VMCounter* ct = &vc.counter[ins->x];
+				if(eof || !IN_CLASS(ct,*SP)) break;
+				countEnter(&vc.count[ins->x],ct,SP - str);
+				if(ct->max != 1) addthread(nlist,nc,ins->next); // count k
+				if(ct->min <= 1) addthread(nlist,nc,code[ins->next].next); // ループの出口
+				break;
+			}
+			case VM_Count:{
+				const VMCounter* ct = &vc.counter[ins->x];
+				VMCountSet* cs = &vc.count[ins->x];
+				if(eof || !IN_CLASS(ct,*SP)){ cs->len = 0; break; }
+				int r = countStep(cs,ct,SP - str);
+				if(r & 1) addthread(nlist,nc,PC);
+				if(r & 2) addthread(nlist,nc,ins->next);
 				break;
+			}
 			case VM_Match:
 				//printf("Match SP:%d PC:%d mPC:%d ",SP,PC,mPC);
 				if(*mSP < SP || (*mSP == SP && PC < mPC) ){
 					*mSP = SP;
 					mPC = PC;
-					tag = ADDR(PC,0);
+					tag = ins->x;
 					//printf("new tag : %d",tag);
 				}
 				//printf("\n");
@@ -88,23 +165,27 @@ int topMatch(RegexVMCode vc,char* str,char** mSP){ // 先頭マッチにより
 
 		}
 
+#if LEX_STATS
+		if(st){
+			st->bytes++;
+			st->sum_cc += cc;
+			st->sum_nc += nc;
+			if((size_t)cc > st->peak_cc) st->peak_cc = cc;
+			if((size_t)nc > st->peak_nc) st->peak_nc = nc;
+		}
+#endif
+
 		// remove flag
-		for(int i=0;i<cc;i++) code[clist[i]] &= ~clist_mask;
+		for(int i=0;i<cc;i++) mark[clist[i]] &= ~clist_mask;
 
-		// return result
+		// return result (終端では nc は必ず 0)
 		if(nc == 0) break;
-		if(*SP == '\0'){
-			printf("*SP == \\0\n");
-			// remove flag
-			for(int i=0;i<nc;i++) code[nlist[i]] &= ~nlist_mask;
-			break;
-		}
 
 		// exchange flag
 		for(int i=0;i<nc;i++){
 			// nflag(at 7bit) -> cflag(at 8bit)	
-			code[nlist[i]] &= ~nlist_mask;	
-			code[nlist[i]] |=  clist_mask; 
+			mark[nlist[i]] &= ~nlist_mask;	
+			mark[nlist[i]] |=  clist_mask; 
 		}
 
 		
@@ -126,6 +207,16 @@ int topMatch(RegexVMCode vc,char* str,char** mSP){ // 先頭マッチにより
 	//printf("matched string : %d chars\n",*(unsigned int*)&mSP-*(unsigned int*)&iSP);
 	//printf("thread_find : %d\n",thread_find);
 
+	if(eSP) *eSP = SP;
+
+#if LEX_STATS
+	if(st){
+		size_t la = SP - *mSP;
+		st->lookahead += la;
+		if(la > st->peak_lookahead) st->peak_lookahead = la;
+	}
+#endif
+
 #if USE_BUF_FLAG
 #else
 	free(nlist);
@@ -135,17 +226,299 @@ int topMatch(RegexVMCode vc,char* str,char** mSP){ // 先頭マッチにより
 	return tag;
 }
 
+int topMatch(RegexVMCode vc,char* str,size_t len,char** mSP){
+	return runVM(vc,str,str + len,mSP,NULL,NULL);
+}
+
+#if LEX_STATS
+int topMatchStats(RegexVMCode vc,char* str,size_t len,char** mSP,VMStats* st){
+	return runVM(vc,str,str + len,mSP,NULL,st);
+}
+#endif
 
 
-Lexer compileLex(char_type* str,SymbolElement* el,int num){
-	Lexer lex;
-	lex.str = str;
-	lex.index = 0;
-	lex.end = false;
+
+
+#if USE_THREADED
+/*
+// 直接スレッディング版
+//
+// emitVMCode の時点でバイトコードを VMInsn の配列に変換しておき、
+// 各命令の op に処理のラベルのアドレスを入れて goto *op で分岐する。
+// 変換時に以下をまとめる (スーパー命令)
+//   jmp の連鎖           : 飛び先,next を最終的な飛び先に置き換える (char->jmp など)
+//   split L1,L2 / char c : L1 の char をその場で調べる splitchar
+//   split L1,L2 / range  : 同様に splitrange
+*/
+
+enum {
+	T_Match,T_Any,T_Char,T_NotChar,T_Range,T_NotRange,T_Split,T_Jmp,
+	T_CountEnter,T_Count,T_SplitN,
+	T_SplitChar,T_SplitRange,
+	T_NUM
+};
+
+static const void* const* threaded_labels; // runThreaded のラベル表
+
+#define addthreadT(list,c,pc) {         \
+	if( !(mark[pc] & list##_mask) ){    \
+		list[c++] = pc;                 \
+		mark[pc] |= list##_mask;        \
+	}                                   \
+}
+
+// vc == NULL のときはラベル表を threaded_labels に設定するだけ
+static int runThreaded(RegexVMCode* vc,char* str,char* end,char** mSP,char** eSP){
+	static const void* const labels[T_NUM] = {
+		[T_Match]     = &&L_Match,     [T_Any]        = &&L_Any,
+		[T_Char]      = &&L_Char,      [T_NotChar]    = &&L_NotChar,
+		[T_Range]     = &&L_Range,     [T_NotRange]   = &&L_NotRange,
+		[T_Split]     = &&L_Split,     [T_Jmp]        = &&L_Jmp,
+		[T_CountEnter] = &&L_CountEnter, [T_Count]    = &&L_Count,
+		[T_SplitN]    = &&L_SplitN,
+		[T_SplitChar] = &&L_SplitChar, [T_SplitRange] = &&L_SplitRange,
+	};
+	if(vc == NULL){
+		threaded_labels = labels;
+		return 0;
+	}
+
+	char* SP = str;
+	*mSP = SP;
+	vm_addr_type mPC = 0xffff;
+	int tag = -1;
+	const VMInsn* insn = vc->insn;
+	const VMInsn* ins;
+	vm_code_type* mark = vc->mark;
+	int nc = 0 , cc = 0 , i;
+	char c;
+	bool eof;
+
+#if USE_BUF_FLAG
+	vm_addr_type* nlist = &vc->buf[ 0 ];
+	vm_addr_type* clist = &vc->buf[ vc->opcode_size ];
+#else
+	vm_addr_type* nlist = (vm_addr_type*)malloc(sizeof(vm_addr_type)*vc->opcode_size);
+	vm_addr_type* clist = (vm_addr_type*)malloc(sizeof(vm_addr_type)*vc->opcode_size);
+#endif
+
+#define NEXT {                                     \
+	if(++i >= cc) goto step_end;                   \
+	ins = &insn[clist[i]];                         \
+	goto *ins->op;                                 \
+}
+
+	resetCounters(vc);
+	addthreadT(clist,cc,0);
+	for(;;){
+		eof = (SP == end);
+		c = eof ? '\0' : *SP;
+		i = 0;
+		ins = &insn[clist[0]];
+		goto *ins->op;
+
+	L_Char:
+		if(!eof && c == ins->a) addthreadT(nlist,nc,ins->next);
+		NEXT;
+	L_Range:
+		if(!eof && ins->a <= c && c <= ins->b) addthreadT(nlist,nc,ins->next);
+		NEXT;
+	L_Any:
+		if(!eof) addthreadT(nlist,nc,ins->next);
+		NEXT;
+	L_NotChar:
+		if(!eof && c != ins->a) addthreadT(clist,cc,ins->next);
+		NEXT;
+	L_NotRange:
+		if(!eof && !(ins->a <= c && c <= ins->b)) addthreadT(clist,cc,ins->next);
+		NEXT;
+	L_Split:
+		addthreadT(clist,cc,ins->x);
+		addthreadT(clist,cc,ins->y);
+		NEXT;
+	L_Jmp:
+		addthreadT(clist,cc,ins->x);
+		NEXT;
+	L_SplitN:{
+		const vm_addr_type* t = &vc->table[ins->x];
+		for(int j = 0;j < ins->y;j++) addthreadT(clist,cc,t[j]);
+		NEXT;
+	}
+	L_SplitChar:
+		if(!eof && c == ins->a) addthreadT(nlist,nc,ins->x);
+		addthreadT(clist,cc,ins->y);
+		NEXT;
+	L_SplitRange:
+		if(!eof && ins->a <= c && c <= ins->b) addthreadT(nlist,nc,ins->x);
+		addthreadT(clist,cc,ins->y);
+		NEXT;
+	L_CountEnter:
+		if(!eof && IN_CLASS(&vc->counter[ins->x],c)){
+			countEnter(&vc->count[ins->x],&vc->counter[ins->x],SP - str);
+			if(vc->counter[ins->x].max != 1) addthreadT(nlist,nc,ins->next);
+			if(vc->counter[ins->x].min <= 1) addthreadT(nlist,nc,ins->y);
+		}
+		NEXT;
+	L_Count:
+		if(!eof && IN_CLASS(&vc->counter[ins->x],c)){
+			int r = countStep(&vc->count[ins->x],&vc->counter[ins->x],SP - str);
+			if(r & 1) addthreadT(nlist,nc,clist[i]);
+			if(r & 2) addthreadT(nlist,nc,ins->next);
+		}
+		else vc->count[ins->x].len = 0;
+		NEXT;
+	L_Match:
+		if(*mSP < SP || (*mSP == SP && clist[i] < mPC) ){
+			*mSP = SP;
+			mPC = clist[i];
+			tag = ins->x;
+		}
+		NEXT;
+
+	step_end:
+		// remove flag
+		for(i=0;i<cc;i++) mark[clist[i]] &= ~clist_mask;
+
+		// return result (終端では nc は必ず 0)
+		if(nc == 0) break;
+
+		// exchange flag
+		for(i=0;i<nc;i++){
+			mark[nlist[i]] &= ~nlist_mask;
+			mark[nlist[i]] |=  clist_mask;
+		}
+
+		swap(vm_addr_type*,nlist,clist);
+		swap(int,nc,cc);
+		nc = 0;
+
+		SP++;
+	}
+#undef NEXT
+
+	if(eSP) *eSP = SP;
+
+#if USE_BUF_FLAG
+#else
+	free(nlist);
+	free(clist);
+#endif
+
+	return tag;
+}
+
+int topMatchThreaded(RegexVMCode vc,char* str,size_t len,char** mSP){
+	return runThreaded(&vc,str,str + len,mSP,NULL);
+}
+
+// jmp を辿った先の命令番号
+static vm_addr_type skipJmp(const VMInsn* insn,const int* kind,vm_addr_type n){
+	for(size_t guard = 0;kind[n] == T_Jmp && guard < 0x10000;guard++) n = insn[n].x;
+	return n;
+}
+
+void buildThreadedCode(RegexVMCode* vc){
+	const VMCode2* code = vc->code2;
+	size_t n = vc->opcode_size;
+	int* kind = malloc(sizeof(int)*n);
+	VMInsn* insn = calloc(n,sizeof(VMInsn));
+
+	if(threaded_labels == NULL) runThreaded(NULL,NULL,NULL,NULL,NULL);
+
+	// v2 形式はすでに命令番号なので、分岐先を x,y に並べ替えるだけ
+	for(size_t k = 0;k < n;k++){
+		VMInsn* in = &insn[k];
+		const VMCode2* c2 = &code[k];
+		in->a = c2->a; in->b = c2->b;
+		in->next = c2->next;
+		switch(kind[k] = c2->op){
+			case VM_Split:      in->x = c2->next; in->y = c2->x; break;
+			case VM_Jmp:        in->x = c2->next; break;
+			case VM_SplitN:     in->x = c2->next; in->y = c2->x; break; // 飛び先表の位置と数
+			case VM_Match:      in->x = c2->x; break;
+			case VM_CountEnter: in->x = c2->x; in->y = code[c2->next].next; break; // y はループの出口
+			case VM_Count:      in->x = c2->x; break;
+		}
+	}
+
+	// jmp の連鎖を飛ばす
+	for(size_t k = 0;k < n;k++){
+		VMInsn* in = &insn[k];
+		switch(kind[k]){
+			case VM_Split: in->y = skipJmp(insn,kind,in->y); // fall through
+			case VM_Jmp:   in->x = skipJmp(insn,kind,in->x); break;
+			case VM_Match: case VM_SplitN: break; // 飛び先表に jmp は無い
+			case VM_CountEnter: in->y = skipJmp(insn,kind,in->y); break;
+			default:       in->next = skipJmp(insn,kind,in->next); break;
+		}
+	}
+
+	// スーパー命令に置き換える (飛び先の命令の中身は jmp の連鎖を飛ばした後のもの)
+	for(size_t k = 0;k < n;k++){
+		VMInsn* in = &insn[k];
+		int t = kind[k];
+		if(t == VM_Split && (kind[in->x] == VM_Char || kind[in->x] == VM_Range)){
+			const VMInsn* l1 = &insn[in->x];
+			t = kind[in->x] == VM_Char ? T_SplitChar : T_SplitRange;
+			in->a = l1->a; in->b = l1->b;
+			in->x = l1->next;
+		}
+		in->op = threaded_labels[t];
+	}
+
+	free(kind);
+
+	vc->insn = insn;
+}
+#endif
+
+// 各規則の解析結果をまとめる (どれかの規則にマッチすればよいので、共通する部分だけが残る)
+static void buildLexFilter(LexFilter* f,RegexAST** asts,int num){
+	RegexInfo info;
+	int i,k;
+
+	for(k=0;k<num;k++){
+		analyzeAST(asts[k],&info);
+		if(k == 0){
+			f->nullable = info.nullable;
+			for(i=0;i<32;i++) f->first[i] = info.first[i];
+			f->pre = info.pre;
+			f->req = info.req;
+			f->req_off = info.req_off;
+			continue;
+		}
+		f->nullable |= info.nullable;
+		for(i=0;i<32;i++) f->first[i] |= info.first[i];
+		for(i=0;i<f->pre.len && i<info.pre.len && f->pre.str[i] == info.pre.str[i];i++) ;
+		f->pre.len = i;
+		if(f->req.len == info.req.len && memcmp(f->req.str,info.req.str,f->req.len) == 0){
+			if(f->req_off >= 0 && (info.req_off < 0 || info.req_off > f->req_off)) f->req_off = info.req_off;
+		}
+		else f->req.len = 0;
+	}
+	if(f->req.len <= f->pre.len){ // 先頭の文字列の方が位置が決まっている
+		f->req = f->pre;
+		f->req_off = 0;
+	}
+
+	f->first_num = 0;
+	for(i=0;i<256;i++){
+		if(f->first[i >> 3] >> (i & 7) & 1){
+			f->first_num++;
+			f->first_char = (char_type)i;
+		}
+	}
+}
+
+// deriv なら DFA を AST の導関数から作る (そうでなければバイトコードの部分集合構成)
+static LexRules compileRules(SymbolElement* el,int num,bool deriv){
+	LexRules rules;
+	rules.num = num;
 
 	RegexAST** asts = malloc(sizeof(RegexAST*)*num);
 	for(int i=0;i<num;i++){
-		asts[i] = parseRegex(&(el[i].reg));
+		char_type* reg = el[i].reg; // parseRegex はポインタを進めるのでコピーを渡す
+		asts[i] = parseRegex(&reg);
 	}
 
 	/*for(int i=0;i<num;i++){
@@ -154,9 +527,17 @@ Lexer compileLex(char_type* str,SymbolElement* el,int num){
 		printf("\n");
 	}*/
 	
-	lex.vc = emitVMCode(asts,el,num);
+	rules.vc = emitVMCode(asts,el,num);
+	buildLexFilter(&rules.filter,asts,num);
+	if(deriv){
+		int* tags = malloc(sizeof(int)*num);
+		for(int i=0;i<num;i++) tags[i] = el[i].tag;
+		rules.dfa = buildLexDFADeriv(asts,tags,num);
+		free(tags);
+	}
+	else rules.dfa = buildLexDFA(&rules.vc);
 
-	//printVMCode(lex.vc);
+	//printVMCode(rules.vc);
 
 	for(int i=0;i<num;i++){
 		freeAST(asts[i]);
@@ -164,31 +545,303 @@ Lexer compileLex(char_type* str,SymbolElement* el,int num){
 
 	free(asts);
 
+	return rules;
+}
+
+LexRules compileLexRules(SymbolElement* el,int num){
+	return compileRules(el,num,false);
+}
+
+LexRules compileLexRulesDeriv(SymbolElement* el,int num){
+	return compileRules(el,num,true);
+}
+
+void freeLexRules(LexRules* rules){
+	freeVMCode(rules->vc);
+	freeLexDFA(rules->dfa);
+	rules->dfa = NULL;
+	rules->num = 0;
+}
+
+Lexer openLex(const LexRules* rules,char_type* str,size_t len){
+	Lexer lex;
+	lex.rules = rules;
+	lex.vc = allocVMWork(rules->vc);
+	lex.owned = NULL;
+	lex.stats = NULL;
+	resetLex(&lex,str,len);
 	return lex;
 }
 
+void resetLex(Lexer* lex,char_type* str,size_t len){
+	lex->str = str;
+	lex->len = len;
+	seekLex(lex,0);
+}
+
+void seekLex(Lexer* lex,size_t index){
+	lex->index = index;
+	lex->end = (index >= lex->len);
+}
+
+void closeLex(Lexer* lex){
+	lex->str = NULL;
+	lex->len = 0;
+	lex->index = 0;
+	freeVMWork(lex->vc);
+	lex->rules = NULL;
+#if LEX_STATS
+	if(lex->stats){
+		free(lex->stats->tag_count);
+		free(lex->stats->vm.hits);
+		free(lex->stats->state_hits);
+		free(lex->stats);
+		lex->stats = NULL;
+	}
+#endif
+}
+
+Lexer compileLex(char_type* str,size_t len,SymbolElement* el,int num){
+	LexRules* rules = malloc(sizeof(LexRules));
+	*rules = compileLexRules(el,num);
+	Lexer lex = openLex(rules,str,len);
+	lex.owned = rules;
+	return lex;
+}
+
+#if LEX_STATS
+static void countTag(LexStats* st,int tag){
+	st->matches++;
+	for(int i=0;i<st->tag_num;i++){
+		if(st->tag_count[i].tag == tag){
+			st->tag_count[i].count++;
+			return;
+		}
+	}
+	if(st->tag_num == st->tag_alloced){
+		st->tag_alloced = st->tag_alloced ? st->tag_alloced*2 : 16;
+		st->tag_count = realloc(st->tag_count,sizeof(LexTagCount)*st->tag_alloced);
+	}
+	st->tag_count[st->tag_num++] = (LexTagCount){tag,1};
+}
+#endif
+
+// m->str から先頭マッチして m を埋める
+// 統計を取るときは命令ごとの回数を数えるために VM (DFA があれば同じ入力で状態ごとの回数も数える)、
+// それ以外は DFA があれば DFA で実行する
+static void runLex(Lexer* lex,Match* m){
+	char *end = lex->str + lex->len;
+	char *msp,*esp;
+#if LEX_STATS
+	if(lex->stats){
+		m->tag = runVM(lex->vc,m->str,end,&msp,&esp,&lex->stats->vm);
+		countTag(lex->stats,m->tag);
+		if(lex->stats->state_hits) profileDFA(lex->rules->dfa,m->str,end,lex->stats->state_hits);
+	}
+	else
+#endif
+	if(lex->rules->dfa) m->tag = runDFA(lex->rules->dfa,m->str,end,&msp,&esp);
+	else
+#if USE_THREADED
+	if(lex->vc.insn) m->tag = runThreaded(&lex->vc,m->str,end,&msp,&esp);
+	else
+#endif
+	m->tag = runVM(lex->vc,m->str,end,&msp,&esp,NULL);
+	m->num = msp - m->str;
+	m->look = esp - msp + 1;
+}
+
+static void noMatch(Match* m){
+	m->num = 0;
+	m->str = NULL;
+	m->tag = -2;
+	m->look = 0;
+}
+
 bool nextMatch(Lexer* lex,Match* m){
 	if(lex->end){
-		m->num = 0;
-		m->str = NULL;
-		m->tag = -2;
+		noMatch(m);
 		return false;
 	}
 
 	m->str = &(lex->str[lex->index]);
-	char* msp;
-	m->tag = topMatch(lex->vc,m->str,&msp);
-	m->num = msp - m->str;
+	runLex(lex,m);
 	lex->index += m->num;
-	lex->end = (*msp == '\0');
+	lex->end = (lex->index == lex->len);
 	return true;
 }
 
+// lex[idx[0..k)] を DFA でまとめて進める
+static int flushMulti(Lexer** lex,const int* idx,int k,Match* m,int cap,int* count){
+	char *str[LEX_MULTI_MAX],*end[LEX_MULTI_MAX];
+	Match* out[LEX_MULTI_MAX];
+	int c[LEX_MULTI_MAX],found = 0;
+
+	for(int j=0;j<k;j++){
+		str[j] = lex[idx[j]]->str + lex[idx[j]]->index;
+		end[j] = lex[idx[j]]->str + lex[idx[j]]->len;
+		out[j] = &m[idx[j]*cap];
+	}
+	runDFAMulti(lex[idx[0]]->rules->dfa,k,str,end,out,cap,c);
+	for(int j=0;j<k;j++){
+		Lexer* l = lex[idx[j]];
+		count[idx[j]] = c[j];
+		for(int t=0;t<c[j];t++) l->index += out[j][t].num;
+		l->end = (l->index == l->len);
+		found += c[j];
+	}
+	return found;
+}
+
+int nextMatchMulti(Lexer** lex,int n,Match* m,int cap,int* count){
+	int idx[LEX_MULTI_MAX];
+	int found = 0, k = 0;
+
+	for(int i=0;i<n;i++){
+		Lexer* l = lex[i];
+		if(l->rules->dfa == NULL || l->rules != lex[0]->rules || l->stats || l->end){ // まとめられないものは1本ずつ
+			for(count[i] = 0;count[i] < cap && nextMatch(l,&m[i*cap + count[i]]);){
+				if(m[i*cap + count[i]++].num == 0) break;
+			}
+			found += count[i];
+			continue;
+		}
+		idx[k++] = i;
+		if(k == LEX_MULTI_MAX){
+			found += flushMulti(lex,idx,k,m,cap,count);
+			k = 0;
+		}
+	}
+	if(k > 0) found += flushMulti(lex,idx,k,m,cap,count);
+	return found;
+}
+
+/*
+// 非アンカーの探索
+//
+// 位置を1つずつ進めて先頭マッチを試すが、その前に規則から取り出した情報で候補を絞る
+//   req   : すべてのマッチに含まれる文字列。p 以降の最初の出現 q を memmem で探し、
+//           無ければ終わり。req_off が有限なら q - req_off より前からはマッチしない
+//   pre   : すべてのマッチの先頭の文字列。memmem (1文字なら memchr) で次の候補に飛ぶ
+//   first : マッチの先頭になりうる文字。1種類なら memchr、そうでなければ表を引いて飛ばす
+// 空文字列にマッチする規則があるときはどの位置でもマッチするので絞らない。
+// マッチの後は末尾 (空マッチなら1つ先) から続ける。
+*/
+bool findMatch(Lexer* lex,Match* m){
+	const LexFilter* f = &lex->rules->filter;
+	char* p = lex->str + lex->index;
+	char* end = lex->str + lex->len;
+	char* q = NULL; // p 以降で最初の req の位置
+
+	if(lex->index > lex->len || (lex->end && !f->nullable)){
+		noMatch(m);
+		return false;
+	}
+
+	for(;p < end || (f->nullable && p == end);p++){
+		if(!f->nullable){
+			if(f->req.len > f->pre.len){
+				if((q == NULL || q < p) && (q = memmem(p,end - p,f->req.str,f->req.len)) == NULL) break;
+				if(f->req_off >= 0 && p < q - f->req_off) p = q - f->req_off;
+			}
+			if(f->pre.len > 1) p = memmem(p,end - p,f->pre.str,f->pre.len);
+			else if(f->first_num == 1) p = memchr(p,f->first_char,end - p);
+			else while(p < end && !(f->first[(unsigned char)*p >> 3] >> ((unsigned char)*p & 7) & 1)) p++;
+			if(p == NULL || p == end) break;
+			if(f->req.len > f->pre.len && q < p){ p--; continue; } // req を探し直す
+		}
+		m->str = p;
+		runLex(lex,m);
+		if(m->tag == -1) continue;
+		lex->index = (p - lex->str) + m->num + (m->num == 0);
+		lex->end = (lex->index >= lex->len);
+		return true;
+	}
+
+	lex->index = lex->len;
+	lex->end = true;
+	noMatch(m);
+	return false;
+}
+
 void freeLex(Lexer* lex){
-	lex->str = NULL;
-	lex->index = 0;
-	freeVMCode(lex->vc);
+	LexRules* owned = lex->owned;
+	closeLex(lex);
+	if(owned){
+		freeLexRules(owned);
+		free(owned);
+	}
 }
 
 
 
+#if LEX_STATS
+// 以降の nextMatch で統計を取る
+void enableLexStats(Lexer* lex){
+	if(lex->stats) return;
+	lex->stats = calloc(1,sizeof(LexStats));
+	lex->stats->vm.hits = calloc(lex->vc.opcode_size,sizeof(size_t));
+	if(lex->rules->dfa) lex->stats->state_hits = calloc(lex->rules->dfa->state_num,sizeof(size_t));
+}
+
+const LexStats* getLexStats(Lexer* lex){
+	return lex->stats;
+}
+
+static const char* opcode_name[VM_OPCODE_MAX] = {
+	[VM_Match] = "match", [VM_Any]      = "any",       [VM_Char]  = "char",
+	[VM_NotChar] = "notchar", [VM_Range] = "range",   [VM_NotRange] = "notrange",
+	[VM_Split] = "split", [VM_Jmp]      = "jmp",
+	[VM_CountEnter] = "countenter", [VM_Count] = "count", [VM_SplitN] = "splitn",
+};
+
+void printLexStats(const LexStats* st,const char* (*tag_name)(int),FILE* fp){
+	const VMStats* vm = &st->vm;
+	size_t total = 0;
+	for(int i=0;i<VM_OPCODE_MAX;i++) total += vm->dispatch[i];
+
+	fprintf(fp,"lex stats:\n");
+	fprintf(fp,"  matches         : %zu\n",st->matches);
+	fprintf(fp,"  bytes scanned   : %zu (%.2f per match)\n",vm->bytes,
+			vm->calls ? (double)vm->bytes/vm->calls : 0.0);
+	fprintf(fp,"  dispatched      : %zu (%.2f per byte)\n",total,
+			vm->bytes ? (double)total/vm->bytes : 0.0);
+	for(int i=0;i<VM_OPCODE_MAX;i++){
+		if(vm->dispatch[i] == 0) continue;
+		fprintf(fp,"    %-12s  : %zu\n",opcode_name[i] ? opcode_name[i] : "?",vm->dispatch[i]);
+	}
+	fprintf(fp,"  cc threads      : max %zu, avg %.2f\n",vm->peak_cc,
+			vm->bytes ? (double)vm->sum_cc/vm->bytes : 0.0);
+	fprintf(fp,"  nc threads      : max %zu, avg %.2f\n",vm->peak_nc,
+			vm->bytes ? (double)vm->sum_nc/vm->bytes : 0.0);
+	fprintf(fp,"  lookahead       : max %zu, avg %.2f\n",vm->peak_lookahead,
+			vm->calls ? (double)vm->lookahead/vm->calls : 0.0);
+	fprintf(fp,"  matches per tag :\n");
+	for(int i=0;i<st->tag_num;i++){
+		const char* name = tag_name ? tag_name(st->tag_count[i].tag) : NULL;
+		if(name) fprintf(fp,"    %-12s  : %zu\n",name,st->tag_count[i].count);
+		else     fprintf(fp,"    %-12d  : %zu\n",st->tag_count[i].tag,st->tag_count[i].count);
+	}
+}
+#endif
+
+
+
+
+void printLexDot(const LexRules* rules,const LexStats* st,const char* (*tag_name)(int),FILE* fp){
+	fprintf(fp,"digraph lexer {\n");
+	fprintf(fp,"    graph [charset = \"UTF-8\", rankdir = LR, fontsize = 10];\n");
+	fprintf(fp,"    node [shape = box, style = filled, fillcolor = white, fontsize = 8];\n");
+	fprintf(fp,"    edge [fontsize = 8];\n");
+	fprintf(fp,"    subgraph cluster_nfa {\n");
+	fprintf(fp,"        label = \"NFA (v2 code, %zu insns)\";\n",rules->vc.opcode_size);
+	printVMCodeDot(rules->vc,st ? st->vm.hits : NULL,tag_name,fp);
+	fprintf(fp,"    }\n");
+	if(rules->dfa){
+		fprintf(fp,"    subgraph cluster_dfa {\n");
+		fprintf(fp,"        label = \"DFA (%d states)\";\n",rules->dfa->state_num - 1);
+		printLexDFADot(rules->dfa,st ? st->state_hits : NULL,tag_name,fp);
+		fprintf(fp,"    }\n");
+	}
+	fprintf(fp,"}\n");
+}
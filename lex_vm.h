@@ -1,6 +1,7 @@
 #ifndef REGEX_VM
 #define REGEX_VM
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -10,22 +11,142 @@
 // コンパイラがC11に対応していないとき定義
 #define CC_OLD
 
+// 実行統計を取れるようにするかどうか (0のとき計測コードは消える)
+#ifndef LEX_STATS
+#define LEX_STATS 1
+#endif
+
+// GCC の computed goto による直接スレッディングを使うかどうか
+#ifndef USE_THREADED
+#ifdef __GNUC__
+#define USE_THREADED 1
+#else
+#define USE_THREADED 0
+#endif
+#endif
+
 typedef char char_type; // 文字を表す型
 
 typedef unsigned short vm_addr_type; // アドレスの型
 typedef unsigned char  vm_code_type; // バイトコードの型
 
+// v2 形式の命令: 8バイト境界に揃えた固定長の命令 (アドレスは命令番号)
+//   char,range,any,notchar,notrange : a,b が文字、next が次の命令
+//   split L1,L2                     : next が L1、x が L2
+//   jmp L                           : next が L
+//   match                           : x がタグ
+//   countenter k                    : x が k、next が count k (ループの出口は count k の next)
+//   count k                         : x が k、next がループの出口
+//   splitn                          : table[next .. next+x) の順に分岐する (split の連鎖をまとめたもの)
+typedef struct {
+	vm_code_type op;     // オペコード
+	char_type a,b;       // 文字、範囲
+	unsigned char pad;
+	vm_addr_type next;   // 次の命令 (分岐では飛び先)
+	vm_addr_type x;      // split の L2、match のタグ、count のカウンタ番号
+} VMCode2;
+
+// 直接スレッディング用に前処理した命令 (アドレスは命令番号)
+typedef struct {
+	const void* op;      // 処理のラベルのアドレス
+	vm_addr_type x,y;    // 飛び先、Match ではタグ、SplitN では飛び先表の位置と数
+	vm_addr_type next;   // 次の命令 (jmp の連鎖は飛ばしてある)
+	char_type a,b;       // 文字、範囲
+} VMInsn;
+
+// 有界繰り返し C{n,m} (C は1文字のクラス) を数える count 命令の情報
+typedef struct {
+	unsigned char cls[32]; // C が受理する文字のビット表
+	int min,max;           // max < 0 は上限なし
+} VMCounter;
+
+// count 命令にいるスレッドのカウンタ値の集合 (実行用の作業領域)
+// すべてのスレッドは同時に1文字進むので、ループに入った位置だけを古い順に覚えておけばよい
+typedef struct {
+	int* entry;          // ループに入った位置のリングバッファ (max+1 個、上限なしなら最も古い1個)
+	int head,len;
+	int step;            // 最後に更新したときの位置 (これより古い内容は空とみなす)
+} VMCountSet;
+
+#define LEX_REPEAT_MAX 1000 // {n,m} の n,m の上限
+#define LEX_REPEAT_EXPAND_MAX 64 // 1文字のクラスでない式の {n,m} を展開してよい写しの数の上限
+
+#define LEX_LIT_MAX 32 // 前処理で扱う文字列の最大長
+
+typedef struct {
+	char_type str[LEX_LIT_MAX];
+	int len;
+} LexLiteral;
+
 typedef struct {
 	size_t code_size,opcode_size;
-	vm_code_type* code;
-	vm_addr_type* buf;
+	vm_code_type* code;  // v1 形式 (1バイトのオペコードに非整列のオペランドが続く、code_size バイト)
+	VMCode2* code2;      // v2 形式 (最適化済み、opcode_size 個)、VM はこちらを実行する
+	vm_addr_type* table; // splitn の飛び先表 (無ければ NULL)
+	vm_addr_type* buf;   // clist,nlist (命令番号、実行用の作業領域)
+	VMInsn* insn;        // 前処理済みの命令列 (opcode_size 個)、無ければ NULL
+	vm_code_type* mark;  // clist,nlist に乗っているかのフラグ (opcode_size 個、実行用の作業領域)
+	int counter_num;
+	VMCounter* counter;  // count 命令の情報 (counter_num 個)
+	VMCountSet* count;   // カウンタ値の集合 (counter_num 個、実行用の作業領域)
 } RegexVMCode;
 
+#define VM_OPCODE_MAX 16 // opcode は下位4bit
+
+typedef struct {
+	size_t calls;                    // topMatch の呼び出し回数
+	size_t bytes;                    // 走査した文字数
+	size_t dispatch[VM_OPCODE_MAX];  // 命令ごとの実行回数
+	size_t peak_cc,peak_nc;          // clist,nlist に同時に乗ったスレッド数の最大
+	size_t sum_cc,sum_nc;            // 平均を出すための cc,nc の合計 (1文字ごと)
+	size_t lookahead,peak_lookahead; // 最後に受理した位置より先に読んだ文字数
+	size_t* hits;                    // v2 の命令ごとの実行回数 (opcode_size 個、NULL なら数えない)
+} VMStats;
+
+typedef struct {
+	int tag;
+	size_t count;
+} LexTagCount;
+
+typedef struct {
+	VMStats vm;
+	size_t matches;
+	int tag_num,tag_alloced;
+	LexTagCount* tag_count; // タグごとのマッチ数 (出現順)
+	size_t* state_hits;     // DFA の状態ごとの到達回数 (状態数個、DFA が無ければ NULL)
+} LexStats;
+
+// findMatch で VM を走らせる位置を絞るための情報 (すべての規則について)
+typedef struct {
+	bool nullable;            // 空文字列にマッチする規則がある (どの位置でもマッチする)
+	unsigned char first[32];  // マッチの先頭になりうる文字
+	int first_num;            // first の文字数
+	char_type first_char;     // first_num が 1 のときのその文字
+	LexLiteral pre;           // すべてのマッチの先頭にある文字列
+	LexLiteral req;           // すべてのマッチに含まれる文字列
+	int req_off;              // マッチの先頭から req までの距離の上限 (-1 は上限なし)
+} LexFilter;
+
+struct LexDFA;
+
+// コンパイル済みの規則 (実行中に書き換えないので複数の Lexer で共有できる)
+typedef struct {
+	RegexVMCode vc;
+	int num; // 規則の数
+	LexFilter filter;
+	struct LexDFA* dfa; // 決定化できたときの DFA (NULL なら VM で実行する)
+} LexRules;
+
+// 入力を走査する側 (規則への参照と作業領域だけを持つ)
 typedef struct {
 	char* str;
+	size_t len; // 入力は str[0..len) (NUL 終端でなくてよい)
 	int index;
 	bool end;
-	RegexVMCode vc;
+	const LexRules* rules;
+	RegexVMCode vc;  // rules のコードとこの Lexer の作業領域
+	LexRules* owned; // compileLex で作ったときの規則 (freeLex で解放する)
+	LexStats* stats; // NULL なら計測しない
 } Lexer;
 
 typedef struct {
@@ -37,16 +158,63 @@ typedef struct {
 	int num;
 	char* str;
 	int tag;
+	int look; // マッチの末尾から先読みした文字数 (止まった位置の文字を含む)
 } Match;
 
 
 
-Lexer compileLex(char_type* str,SymbolElement* el,int num);
+int topMatch(RegexVMCode vc,char* str,size_t len,char** mSP); // str[0..len) の先頭でマッチ
+
+#if USE_THREADED
+void buildThreadedCode(RegexVMCode* vc);
+
+int topMatchThreaded(RegexVMCode vc,char* str,size_t len,char** mSP);
+#endif
+
+#if LEX_STATS
+int topMatchStats(RegexVMCode vc,char* str,size_t len,char** mSP,VMStats* st);
+#endif
+
+LexRules compileLexRules(SymbolElement* el,int num);
+
+// DFA を正規表現の導関数から直接作る (規則が多いときにコンパイルが速い。count 命令があっても作れる)
+LexRules compileLexRulesDeriv(SymbolElement* el,int num);
+
+void freeLexRules(LexRules* rules);
+
+Lexer openLex(const LexRules* rules,char_type* str,size_t len); // rules は Lexer より長く生きること
+
+void resetLex(Lexer* lex,char_type* str,size_t len); // 別の入力を先頭から読む
+
+void seekLex(Lexer* lex,size_t index); // 同じ入力の index から読み直す
+
+void closeLex(Lexer* lex);
+
+Lexer compileLex(char_type* str,size_t len,SymbolElement* el,int num); // 規則を自分で持つ Lexer
 
 bool nextMatch(Lexer* lex,Match* m);
 
+bool findMatch(Lexer* lex,Match* m); // 現在位置以降で最も左から始まるマッチを探す (grep 用)
+
+// 複数の Lexer をそれぞれ最大 cap トークン進める (まとめて字句解析する用)
+// lex[i] のマッチは m[i*cap ..] に nextMatch を繰り返したのと同じものが count[i] 個入る
+// 空マッチ (字句エラー) の後はその Lexer を進めない。全体のマッチ数を返す
+// lex[0] と同じ規則の Lexer は DFA の遷移を交互に進めて、読み込みの待ちを重ねる
+int nextMatchMulti(Lexer** lex,int n,Match* m,int cap,int* count);
+
 void freeLex(Lexer* lex);
 
+#if LEX_STATS
+void enableLexStats(Lexer* lex);
+
+const LexStats* getLexStats(Lexer* lex);
+
+void printLexStats(const LexStats* st,const char* (*tag_name)(int),FILE* fp); // tag_name は NULL でもよい
+#endif
+
+// 規則の v2 コードと DFA を DOT で書く (st があれば命令と状態を実行回数で色付けしたヒートマップ)
+void printLexDot(const LexRules* rules,const LexStats* st,const char* (*tag_name)(int),FILE* fp);
+
 
 
 
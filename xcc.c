@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -6,62 +7,116 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <regex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lex_vm.h"
 
+// 生成規則を区別するノードの種類 (表示には ast_kind_name を使う)
+enum ast_kind {
+	AST_TRANSLATION_UNIT,
+	AST_TRANSLATION_UNIT_ELEMENT,
+	AST_TYPE_SPECIFIER,
+	AST_DECLARATOR,
+	AST_DIRECT_DECLARATOR,
+	AST_DIRECT_DECLARATOR_PARAMETER,
+	AST_PARAMETER_DECLARATION,
+	AST_STATEMENT_LABEL,
+	AST_STATEMENT_EXP,
+	AST_STATEMENT_IF,
+	AST_STATEMENT_WHILE,
+	AST_STATEMENT_GOTO,
+	AST_STATEMENT_RETURN,
+	AST_COMPOUND_STATEMENT,
+	AST_EXP,
+	AST_EXP9,
+	AST_EXP8,
+	AST_EXP7,
+	AST_EXP6,
+	AST_EXP5,
+	AST_EXP4,
+	AST_EXP3,
+	AST_EXP2,
+	AST_EXP1,
+	AST_PRIMARY,
+	AST_ARGUMENT_EXPRESSION_LIST,
+	AST_EXP_EMPTY,
+	AST_ID,
+	AST_INT,
+	AST_CHAR,
+	AST_STRING,
+	AST_TOKEN,   // 演算子やキーワードの葉 (種類は token に持つ)
+	AST_KIND_NUM
+};
+
+/*
+ * 構文木のノードは cur->nodes にまとめて置き、32bit の添字 (ast_id) で指す
+ * 子の添字は cur->kids に親ごとに連続して並び、葉の字句はトークン番号で引く
+ */
+typedef unsigned int ast_id;
+#define AST_NONE 0               // NULL の代わり (nodes[0] は使わない)
+
 struct AST {
-    char        *ast_type;   // 生成規則を区別
-    struct AST	*parent;     // 親へのバックポインタ
-    int	       	nth;         // 自分が何番目の兄弟か
-    int         num_child;   // 子ノードの数
-    struct AST  **child;     // 子ノードポインタの配列
-    char        *lexeme;     // 葉ノード用 (整数，文字，文字列の定数，識別子）
+    unsigned int kind : 8;       // 生成規則を区別 (enum ast_kind)
+    unsigned int num_child : 24; // 子ノードの数
+    unsigned int arg;            // 子があれば kids での先頭の位置、葉なら字句のトークン番号
 };
 
 /* ------------------------------------------------------- */
+struct token;
 static void print_nspace (int n);
-static struct AST* create_AST (char *ast_type, int num_child, ...);
-static struct AST* create_leaf (char *ast_type, char *lexeme);
-static struct AST* add_AST (struct AST *ast, int num_child, ...);
-static void show_AST (struct AST *ast, int depth);
-static void unparse_AST (struct AST *ast, int depth);
-
-static void unparse_error (struct AST *ast);
-
-static struct AST* parse_translation_unit (void);
-static struct AST* parse_type_specifier (void);
-static struct AST* parse_declarator (void);
-static struct AST* parse_direct_declarator (void);
-static struct AST* parse_parameter_declaration (void);
-static struct AST* parse_statement (void);
-static struct AST* parse_compound_statement (void); 
-static struct AST* parse_exp (void);
-static struct AST* parse_exp1 (void);
-static struct AST* parse_exp2 (void);
-static struct AST* parse_exp3 (void);
-static struct AST* parse_exp4 (void);
-static struct AST* parse_exp5 (void);
-static struct AST* parse_exp6 (void);
-static struct AST* parse_exp7 (void);
-static struct AST* parse_exp8 (void);
-static struct AST* parse_exp9 (void);
-static struct AST* parse_primary (void);
-static struct AST* parse_argument_expression_list (void);
-
-static char* map_file (char *filename);
+static ast_id create_AST (enum ast_kind kind, int num_child, ...);
+static ast_id create_leaf (enum ast_kind kind, struct token *t);
+static struct AST* ast_node (ast_id ast);
+static ast_id* ast_children (ast_id ast);
+static char* ast_lexeme (ast_id ast);
+static const char* ast_name (ast_id ast);
+static int begin_AST (void);
+static void push_AST (ast_id child);
+static ast_id finish_AST (enum ast_kind kind, int base);
+static void show_AST (ast_id ast, int depth);
+static void unparse_AST (ast_id ast, int depth);
+
+static void unparse_error (ast_id ast);
+
+static ast_id parse_translation_unit (void);
+static ast_id parse_type_specifier (void);
+static ast_id parse_declarator (void);
+static ast_id parse_direct_declarator (void);
+static ast_id parse_parameter_declaration (void);
+static ast_id parse_statement (void);
+static ast_id parse_compound_statement (void); 
+static ast_id parse_exp (void);
+static ast_id parse_exp1 (void);
+static ast_id parse_exp2 (void);
+static ast_id parse_binary (int level);
+static ast_id parse_primary (void);
+static ast_id parse_argument_expression_list (void);
+
+static char* map_file (char *filename, int *size);
 static void* copy_string_region_int (char *s, int start, int end);
-static int set_token_int (char *ptr, int begin, int end, int kind, int off);
-static void create_tokens (char *ptr);
+static int set_token_int (struct token *t, char *ptr, int begin, int end, int kind, int off);
+static void create_tokens (char *ptr, int size);
+static char* relex_tokens (char *src, int size, int offset, int del, char *ins, int *new_size);
 static void dump_tokens ();
+static void build_line_index (char *ptr, size_t size);
+static void offset_to_linecol (int offset, int *line, int *col);
 /* ------------------------------------------------------- */
 // データ構造と変数
 
-#define MAX_TOKENS 10000
 struct token {
     int kind;
     int offset_begin; 
     int offset_end;
+    int offset_scan;  // この字句までに字句解析器が読んだ最も先のオフセット
     char *lexeme;
 };
 enum token_kind {
@@ -136,10 +191,271 @@ char* token_kind_name[] = {
     ['-'] = "-", ['+'] = "+", ['*'] = "*", ['/'] = "/", ['<'] = "<",
 };
 
+const char* ast_kind_name[AST_KIND_NUM] = {
+	[AST_TRANSLATION_UNIT] = "translation_unit",
+	[AST_TRANSLATION_UNIT_ELEMENT] = "translation_unit_element",
+	[AST_TYPE_SPECIFIER] = "type_specifier",
+	[AST_DECLARATOR] = "declarator",
+	[AST_DIRECT_DECLARATOR] = "direct_declarator",
+	[AST_DIRECT_DECLARATOR_PARAMETER] = "direct_declarator_parameter",
+	[AST_PARAMETER_DECLARATION] = "parameter_declaration",
+	[AST_STATEMENT_LABEL] = "statement_label",
+	[AST_STATEMENT_EXP] = "statement_exp",
+	[AST_STATEMENT_IF] = "statement_if",
+	[AST_STATEMENT_WHILE] = "statement_while",
+	[AST_STATEMENT_GOTO] = "statement_goto",
+	[AST_STATEMENT_RETURN] = "statement_return",
+	[AST_COMPOUND_STATEMENT] = "compound_statement",
+	[AST_EXP] = "exp",
+	[AST_EXP9] = "exp9",
+	[AST_EXP8] = "exp8",
+	[AST_EXP7] = "exp7",
+	[AST_EXP6] = "exp6",
+	[AST_EXP5] = "exp5",
+	[AST_EXP4] = "exp4",
+	[AST_EXP3] = "exp3",
+	[AST_EXP2] = "exp2",
+	[AST_EXP1] = "exp1",
+	[AST_PRIMARY] = "primary",
+	[AST_ARGUMENT_EXPRESSION_LIST] = "argument_expression_list",
+	[AST_EXP_EMPTY] = "exp_empty",
+	[AST_ID] = "TK_ID",
+	[AST_INT] = "TK_INT",
+	[AST_CHAR] = "TK_CHAR",
+	[AST_STRING] = "TK_STRING",
+};
+
+static int opt_lex_stats = 0; // --lex-stats
+static int opt_stats = 0;     // --stats
+static int opt_huge_pages = 0; // --huge-pages
+static char *opt_trace = NULL; // --trace=FILE
+static char *opt_lex_dot = NULL; // --lex-dot=FILE
+static int opt_stack_parse = 0; // --stack-parse
+
+#define HUGE_PAGE_MIN (2 << 20) // これより小さい入力には huge page を勧めない
+
+/* ------------------------------------------------------- */
+// --stats 用の計測 (フェーズごとの時間とメモリ確保)
+
+enum phase {
+	PHASE_MAP, PHASE_LEX, PHASE_PARSE, PHASE_GRAPH, PHASE_UNPARSE, PHASE_NUM
+};
+
+static char *phase_name [PHASE_NUM] = { "map", "lex", "parse", "graph", "unparse" };
+
+struct phase_stats {
+	double wall, cpu;         // 秒
+	size_t mallocs, reallocs; // 呼び出し回数
+	size_t bytes;             // 要求したバイト数
+};
+
+// --trace 用の区間 (Chrome Trace Event の "X" イベント)
+struct trace_event {
+	const char *name;    // 静的な文字列
+	char *arg;           // 宣言子の名前など (無ければ NULL)
+	long long ts, dur;   // ns
+	int tid;
+};
+
+struct trace {
+	struct trace_event *ev;
+	int num, alloced;
+};
+
+/*
+ * 1つの入力ファイルのコンパイルに関する状態
+ * --batch では複数のファイルを並列に処理するので、スレッドごとに cur を切り替える
+ */
+struct compilation {
+    char *input;                   // ファイル名
+    char *src;                     // ソース (map_file か relex_tokens が作ったもの)
+    int src_size;
+    int src_mapped;                // src が mmap されたものか
+
+    struct token *tokens;          // 字句の列 (後ろに kind == TK_UNUSED の空の字句が必ず2つ以上ある)
+    int tokens_alloced;
+    int tokens_index;
+    struct token *token_p;         // for parsing
+
+    int *line_begin;               // 各行の先頭のオフセット (line_begin[0] == 0)
+    int num_lines;
+    int line_alloced;
+
+    Lexer lex;                     // lex_rules を読む走査器
+    FILE *out, *err;               // unparse の出力とエラー出力
+    jmp_buf error;                 // エラー時の戻り先 (compile_file)
+
+    struct phase_stats phase_stats [PHASE_NUM];
+    enum phase cur_phase;
+    double phase_wall0, phase_cpu0;
+    int num_tokens;
+    int num_ast_nodes;
+
+    struct AST *nodes;             // 構文木のノード (compile_file の終わりにまとめて解放)
+    int num_nodes, nodes_alloced;
+    ast_id *kids;                  // 子の添字 (ノードごとに連続する)
+    int num_kids, kids_alloced;
+    ast_id *scratch;               // 作りかけのノードの子を積むスタック (begin_AST .. finish_AST)
+    int scratch_num, scratch_alloced;
+    struct pframe *pstack;         // --stack-parse の呼び出しスタック
+    int pstack_num, pstack_alloced;
+    struct walk *walk;             // 木をたどるときの作業スタック (unparse, DOT 出力など)
+    int walk_num, walk_alloced;
+
+    struct trace trace;            // --trace の区間 (ファイルごと、最後にまとめて書く)
+    int trace_tid;                 // 区間を記録したスレッドの番号
+    long long phase_ns0;
+};
+
+static __thread struct compilation *cur;
+
+static LexRules lex_rules; // token_table をコンパイルしたもの (main で一度だけ作る)
+
+static double clock_sec(clockid_t id){
+	struct timespec ts;
+	clock_gettime(id,&ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long long trace_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts); // vDSO で読むのでシステムコールにはならない
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void trace_add(struct trace *tr,const char *name,const char *arg,long long t0,int tid){
+	if(tr->num == tr->alloced){
+		tr->alloced = tr->alloced ? tr->alloced * 2 : 64;
+		tr->ev = realloc(tr->ev,sizeof(struct trace_event) * tr->alloced); // 計測対象の確保に数えない
+	}
+	struct trace_event *e = &tr->ev[tr->num++];
+	e->name = name;
+	e->arg = arg ? strdup(arg) : NULL;
+	e->ts = t0;
+	e->dur = trace_now() - t0;
+	e->tid = tid;
+}
+
+static void trace_free(struct trace *tr){
+	for(int i=0;i<tr->num;i++) free(tr->ev[i].arg);
+	free(tr->ev);
+	tr->ev = NULL;
+	tr->num = tr->alloced = 0;
+}
+
+static void phase_begin(enum phase ph){
+	cur->cur_phase = ph;
+	if(opt_trace) cur->phase_ns0 = trace_now();
+	if(!opt_stats) return;
+	cur->phase_wall0 = clock_sec(CLOCK_MONOTONIC);
+	cur->phase_cpu0  = clock_sec(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static void phase_end(void){
+	if(opt_trace) trace_add(&cur->trace,phase_name[cur->cur_phase],NULL,cur->phase_ns0,cur->trace_tid);
+	if(!opt_stats) return;
+	cur->phase_stats[cur->cur_phase].wall += clock_sec(CLOCK_MONOTONIC) - cur->phase_wall0;
+	cur->phase_stats[cur->cur_phase].cpu  += clock_sec(CLOCK_THREAD_CPUTIME_ID) - cur->phase_cpu0;
+}
+
+// xcc 内のメモリ確保はすべてここを通す
+static void* xmalloc(size_t size){
+	cur->phase_stats[cur->cur_phase].mallocs++;
+	cur->phase_stats[cur->cur_phase].bytes += size;
+	return malloc(size);
+}
+
+static void* xrealloc(void* p,size_t size){
+	cur->phase_stats[cur->cur_phase].reallocs++;
+	cur->phase_stats[cur->cur_phase].bytes += size;
+	return realloc(p,size);
+}
+
+// 配列 *p を少なくとも n 要素入るように倍々で伸ばす
+static void* grow_array(void *p,int *alloced,int n,size_t size,int first){
+	if(n <= *alloced) return p;
+	int m = *alloced ? *alloced : first;
+	while(m < n) m *= 2;
+	*alloced = m;
+	return xrealloc(p,size * m);
+}
+
+// --batch では全ファイルの合計 (時間は各スレッドの和) を表示する
+static void print_stats(struct compilation **cs,int n){
+	struct rusage ru;
+	struct phase_stats sum[PHASE_NUM] = {{0}};
+	int tokens = 0, nodes = 0;
+	getrusage(RUSAGE_SELF,&ru);
+
+	for(int j=0;j<n;j++){
+		for(int i=0;i<PHASE_NUM;i++){
+			struct phase_stats *ps = &cs[j]->phase_stats[i];
+			sum[i].wall += ps->wall;
+			sum[i].cpu  += ps->cpu;
+			sum[i].mallocs  += ps->mallocs;
+			sum[i].reallocs += ps->reallocs;
+			sum[i].bytes    += ps->bytes;
+		}
+		tokens += cs[j]->num_tokens;
+		nodes  += cs[j]->num_ast_nodes;
+	}
+
+	fprintf(stderr,"%-8s %10s %10s %8s %8s %10s\n","phase","wall(ms)","cpu(ms)","malloc","realloc","bytes");
+	for(int i=0;i<PHASE_NUM;i++){
+		struct phase_stats *ps = &sum[i];
+		fprintf(stderr,"%-8s %10.3f %10.3f %8zu %8zu %10zu\n",phase_name[i],
+				ps->wall*1e3,ps->cpu*1e3,ps->mallocs,ps->reallocs,ps->bytes);
+	}
+	fprintf(stderr,"peak RSS  : %ld KB\n",ru.ru_maxrss);
+	if(n > 1) fprintf(stderr,"files     : %d\n",n);
+	fprintf(stderr,"tokens    : %d\n",tokens);
+	fprintf(stderr,"AST nodes : %d\n",nodes);
+}
+
+static struct trace main_trace; // main スレッドでの区間 (字句規則のコンパイル)
+static long long trace_t0;      // 時刻の原点
+
+static void json_string(FILE *fp,const char *s){
+	fputc('"',fp);
+	for(;*s;s++){
+		if(*s == '"' || *s == '\\') fprintf(fp,"\\%c",*s);
+		else if((unsigned char)*s < 0x20) fprintf(fp,"\\u%04x",*s);
+		else fputc(*s,fp);
+	}
+	fputc('"',fp);
+}
+
+static void write_trace_events(FILE *fp,struct trace *tr,const char *file,int *first){
+	for(int i=0;i<tr->num;i++){
+		struct trace_event *e = &tr->ev[i];
+		fprintf(fp,"%s\n{\"name\":",*first ? "" : ",");
+		json_string(fp,e->arg ? e->arg : e->name);
+		fprintf(fp,",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+				e->name,(e->ts - trace_t0) * 1e-3,e->dur * 1e-3,e->tid);
+		if(file != NULL){
+			fprintf(fp,",\"args\":{\"file\":");
+			json_string(fp,file);
+			fprintf(fp,"}");
+		}
+		fprintf(fp,"}");
+		*first = 0;
+	}
+}
 
-static struct token tokens [MAX_TOKENS];
-static int tokens_index = 0;
-static struct token *token_p; // for parsing
+// Chrome Trace Event 形式 (chrome://tracing や Perfetto で読める)
+static void write_trace(struct compilation **cs,int n){
+	FILE *fp = fopen(opt_trace,"w");
+	int first = 1;
+	if(fp == NULL){
+		perror(opt_trace);
+		return;
+	}
+	fprintf(fp,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	write_trace_events(fp,&main_trace,NULL,&first);
+	for(int j=0;j<n;j++) write_trace_events(fp,&cs[j]->trace,cs[j]->input,&first);
+	fprintf(fp,"\n]}\n");
+	fclose(fp);
+}
 
 /* ------------------------------------------------------- */
 
@@ -149,124 +465,209 @@ print_nspace (int n)
     printf ("%*s", n, "");
 }
 
+static ast_id
+alloc_AST (enum ast_kind kind, int num_child)
+{
+    if (cur->num_nodes == 0) cur->num_nodes = 1; // AST_NONE の分
+    cur->nodes = grow_array (cur->nodes, &cur->nodes_alloced, cur->num_nodes + 1, sizeof (struct AST), 1024);
+    cur->kids = grow_array (cur->kids, &cur->kids_alloced, cur->num_kids + num_child, sizeof (ast_id), 1024);
+    cur->num_ast_nodes++;
+    ast_id ast = cur->num_nodes++;
+    struct AST *n = &cur->nodes [ast];
+    n->kind      = kind;
+    n->num_child = num_child;
+    n->arg       = cur->num_kids;
+    cur->num_kids += num_child;
+    return ast;
+}
+
 static struct AST*
-create_AST (char *ast_type, int num_child, ...)
+ast_node (ast_id ast)
+{
+    return &cur->nodes [ast];
+}
+
+static ast_id*
+ast_children (ast_id ast)
+{
+    return &cur->kids [cur->nodes [ast].arg];
+}
+
+static char*
+ast_lexeme (ast_id ast)
+{
+    switch (cur->nodes [ast].kind) {
+    case AST_ID: case AST_INT: case AST_CHAR: case AST_STRING: case AST_TOKEN:
+        return cur->tokens [cur->nodes [ast].arg].lexeme;
+    case AST_EXP_EMPTY:
+        return " ";
+    default:
+        return NULL;
+    }
+}
+
+// DOT 出力などで使うノードの名前 (AST_TOKEN はトークンの名前)
+static const char*
+ast_name (ast_id ast)
+{
+    struct AST *n = &cur->nodes [ast];
+    if (n->kind == AST_TOKEN) return token_kind_name [cur->tokens [n->arg].kind];
+    return n->kind < AST_KIND_NUM ? ast_kind_name [n->kind] : "?";
+}
+
+static ast_id
+create_AST (enum ast_kind kind, int num_child, ...)
 {
     va_list ap;
-    struct AST *ast;
-    ast = malloc (sizeof (struct AST));
-    ast->parent = NULL;
-    ast->nth    = -1;
-    ast->ast_type = ast_type;
-    ast->num_child = num_child;
-    ast->lexeme = NULL;
+    ast_id ast = alloc_AST (kind, num_child);
     va_start (ap, num_child);
-    if (num_child == 0) {
-        ast->child = NULL;
-    } else {
-        int i;
-    	ast->child = malloc (sizeof(struct AST *) * num_child);
-	for (i = 0; i < num_child; i++) {
-	    struct AST *child = va_arg (ap, struct AST *);
-	    ast->child [i] = child;
-	    if (child != NULL) {
-		child->parent = ast;
-		child->nth    = i;
-	    }
-    	}
-    }
+    for (int i = 0; i < num_child; i++)
+        ast_children (ast) [i] = va_arg (ap, ast_id);
     va_end (ap);
     return ast;
 }
 
-static struct AST*
-create_leaf (char *ast_type, char *lexeme)
+// 字句は t のもの (t が NULL なら持たない)
+static ast_id
+create_leaf (enum ast_kind kind, struct token *t)
 {
-    struct AST *ast;
-    ast = malloc (sizeof (struct AST));
-    ast->parent    = NULL;
-    ast->nth       = -1;
-    ast->ast_type  = ast_type;
-    ast->num_child = 0;
-    ast->child     = NULL;
-    ast->lexeme    = lexeme;
+    ast_id ast = alloc_AST (kind, 0);
+    cur->nodes [ast].arg = t != NULL ? t - cur->tokens : 0;
     return ast;
 }
 
-static struct AST*
-add_AST (struct AST *ast, int num_child, ...)
+/*
+ * 子の数が読み終わるまで分からないノードは、子を scratch に積んでおき
+ * finish_AST で一度に kids へ移す (入れ子の規則は自分の base より上だけを使う)
+ */
+static int
+begin_AST (void)
 {
-    va_list ap;
-    int i, start = ast->num_child;
-    ast->num_child += num_child;
-    assert (num_child > 0);
-    ast->child = realloc (ast->child, sizeof(struct AST *) * ast->num_child);
-    va_start (ap, num_child);
-    for (i = start; i < ast->num_child; i++) {
-        struct AST *child = va_arg (ap, struct AST *);
-        ast->child [i] = child;
-        if (child != NULL) {
-            child->parent = ast;
-            child->nth    = i;
-        }
-    }
-    va_end (ap);
+    return cur->scratch_num;
+}
+
+static void
+push_AST (ast_id child)
+{
+    cur->scratch = grow_array (cur->scratch, &cur->scratch_alloced, cur->scratch_num + 1, sizeof (ast_id), 256);
+    cur->scratch [cur->scratch_num++] = child;
+}
+
+static ast_id
+finish_AST (enum ast_kind kind, int base)
+{
+    int n = cur->scratch_num - base;
+    ast_id ast = alloc_AST (kind, n);
+    if (n > 0)   // 子の無い節では両方 NULL になる
+        memcpy (ast_children (ast), &cur->scratch [base], sizeof (ast_id) * n);
+    cur->scratch_num = base;
     return ast;
 }
 
+/*
+ * 入れ子の深さだけ C のスタックを使わないように、木をたどる処理は
+ * cur->walk に残りの仕事を積んで進める (base より上だけを使う)
+ */
+enum walk_op { W_NODE, W_STR, W_INDENT };
+
+struct walk {
+    enum walk_op op;
+    ast_id ast;
+    int arg;                     // 字下げの深さ、または DOT の親のノード番号
+    int pos;                     // DOT の親での位置
+    const char *str;             // W_STR で書く文字列
+};
+
+static struct walk*
+walk_push (enum walk_op op, ast_id ast, int arg)
+{
+    cur->walk = grow_array (cur->walk, &cur->walk_alloced, cur->walk_num + 1, sizeof (struct walk), 256);
+    struct walk *w = &cur->walk [cur->walk_num++];
+    w->op  = op;
+    w->ast = ast;
+    w->arg = arg;
+    w->pos = 0;
+    w->str = NULL;
+    return w;
+}
+
+// walk[top..walk_num) を逆順にする (前から積んだものを先頭から取り出せるように)
+static void
+walk_reverse (int top)
+{
+    for (int i = top, j = cur->walk_num - 1; i < j; i++, j--) {
+        struct walk w = cur->walk [i];
+        cur->walk [i] = cur->walk [j];
+        cur->walk [j] = w;
+    }
+}
+
 static void
-show_AST (struct AST *ast, int depth)
+show_AST (ast_id ast, int depth)
 {
     int i;
     print_nspace (depth);
-    if (   !strcmp (ast->ast_type, "TK_ID")
-        || !strcmp (ast->ast_type, "TK_INT")
-        || !strcmp (ast->ast_type, "TK_CHAR")
-        || !strcmp (ast->ast_type, "TK_STRING")) {
-        printf ("%s (%s)\n", ast->ast_type, ast->lexeme); 
-    } else {
-        printf ("%s\n", ast->ast_type); 
+    switch (ast_node (ast)->kind) {
+    case AST_ID: case AST_INT: case AST_CHAR: case AST_STRING:
+        printf ("%s (%s)\n", ast_name (ast), ast_lexeme (ast)); 
+        break;
+    default:
+        printf ("%s\n", ast_name (ast)); 
+        break;
     }
         
-    for (i = 0; i < ast->num_child; i++) {
-        if (ast->child [i] != NULL) {
-            show_AST (ast->child [i], depth +1);
+    for (i = 0; i < ast_node (ast)->num_child; i++) {
+        if (ast_children (ast) [i] != AST_NONE) {
+            show_AST (ast_children (ast) [i], depth +1);
         }
     }
 }
 /* ------------------------------------------------------- */
 // 構文解析
 
+// 診断の行の先頭に "ファイル名:行:桁: " を書く (--batch でどの入力のものか分かるように)
+static void
+diag_at (FILE *fp, int offset)
+{
+    int line, col;
+    offset_to_linecol (offset, &line, &col);
+    fprintf (fp, "%s:%d:%d: ", cur->input, line, col);
+}
+
 static void
 parse_error (void)
 {
-    fprintf (stderr, "parse error (%d-%d): %s (%s)\n",
-             token_p->offset_begin, token_p->offset_end,
-             token_kind_string [token_p->kind], token_p->lexeme);
-    exit (1);
+    int line_b, col_b, line_e, col_e;
+    offset_to_linecol (cur->token_p->offset_begin, &line_b, &col_b);
+    offset_to_linecol (cur->token_p->offset_end, &line_e, &col_e);
+    diag_at (cur->err, cur->token_p->offset_begin);
+    fprintf (cur->err, "parse error (%d:%d-%d:%d): %s (%s)\n",
+             line_b, col_b, line_e, col_e,
+             token_kind_string [cur->token_p->kind], cur->token_p->lexeme);
+    longjmp (cur->error, 1);
 }
 
 static int
 lookahead (int i)
 {
 	// printf("look: %s\n",tokens[tokens_index+i-1].lexeme);
-    return tokens [tokens_index + i - 1].kind;
+    return cur->tokens [cur->tokens_index + i - 1].kind;
 }
 
 static struct token*
 next_token (void)
 {
-    token_p = &tokens [++tokens_index];
-    assert (tokens_index < MAX_TOKENS);
-    return token_p;
+    cur->token_p = &cur->tokens [++cur->tokens_index];
+    assert (cur->tokens_index < cur->tokens_alloced);
+    return cur->token_p;
 }
 
 static struct token*
 reset_tokens (void)
 {
-    tokens_index = 0;
-    token_p = &tokens [tokens_index];
-    return token_p;
+    cur->tokens_index = 0;
+    cur->token_p = &cur->tokens [cur->tokens_index];
+    return cur->token_p;
 }
 
 static void
@@ -275,7 +676,8 @@ consume_token (enum token_kind kind)
     if (lookahead (1) == kind) {
         next_token ();
     } else {
-		fprintf(stderr,"expect token : %s\n",token_kind_string[kind]);
+		diag_at(cur->err,cur->token_p->offset_begin);
+		fprintf(cur->err,"expect token : %s\n",token_kind_string[kind]);
         parse_error ();
     }
 }
@@ -283,13 +685,13 @@ consume_token (enum token_kind kind)
 
 
 static struct token* eat_token(void){
-	assert(tokens_index + 1 < MAX_TOKENS);
-	return token_p = &tokens[tokens_index++];
+	assert(cur->tokens_index + 1 < cur->tokens_alloced);
+	return cur->token_p = &cur->tokens[cur->tokens_index++];
 }
 
-static void consume_and_add(struct AST** ast,int kind){
+static void consume_and_push(int kind){
 	consume_token(kind);
-	*ast = add_AST(*ast,1,create_leaf(token_kind_name[kind],token_kind_string[kind]));
+	push_AST(create_leaf(AST_TOKEN,&cur->tokens[cur->tokens_index - 1]));
 }
 
 // exp,exp2-9のfirst set
@@ -311,13 +713,13 @@ static int expect_exp1(enum token_kind k){
 
 
 // type_specifier : "void" | "char" | "int" ;
-static struct AST* parse_type_specifier (void){
-	struct AST* ast;
+static ast_id parse_type_specifier (void){
+	ast_id ast;
 	struct token* t;
 	switch(lookahead(1)){
 		case TK_KW_INT: case TK_KW_CHAR: case TK_KW_VOID:
 			t = eat_token();
-			ast = create_AST("type_specifier",1, create_leaf(token_kind_name[t->kind],t->lexeme));
+			ast = create_AST(AST_TYPE_SPECIFIER,1, create_leaf(AST_TOKEN,t));
 			break;
 		default: parse_error();
 	}
@@ -327,14 +729,11 @@ static struct AST* parse_type_specifier (void){
 
 
 // declarator : ( "*" )* direct_declarator ;
-static struct AST* parse_declarator (void){
-	struct AST* ast = NULL;
-	struct AST* child = NULL;
-	if(lookahead(1) == '*'){
-		ast = create_AST("declarator",0);
-		while(lookahead(1) == '*'){
-			consume_and_add(&ast,'*');
-		}
+static ast_id parse_declarator (void){
+	ast_id child = AST_NONE;
+	int base = begin_AST();
+	while(lookahead(1) == '*'){
+		consume_and_push('*');
 	}
 	switch(lookahead(1)){
 		case TK_ID:
@@ -344,27 +743,25 @@ static struct AST* parse_declarator (void){
 		default: parse_error();
 	}
 
-	if(ast == NULL) return child;
+	if(cur->scratch_num == base) return child;
 
-	ast = add_AST(ast,1,child);
-	return ast;
+	push_AST(child);
+	return finish_AST(AST_DECLARATOR,base);
 }
 
 
 // direct_declarator : ( IDENTIFIER | "(" declarator ")" ) ( "(" [ parameter_declaration ( "," parameter_declaration )* ] ")" )* ;
-static struct AST* parse_direct_declarator (void){
-	struct AST* ast = create_AST("direct_declarator",0);
-	struct AST* child,*param;
+static ast_id parse_direct_declarator (void){
+	int base = begin_AST(),pbase;
 	struct token* t;
 	switch(lookahead(1)){
 		case TK_ID:
 			t = eat_token();
-			child = create_leaf("TK_ID",t->lexeme);
-			ast = add_AST(ast,1,child);
+			push_AST(create_leaf(AST_ID,t));
 			break;
 		case '(':
 			consume_token('(');
-			ast = add_AST(ast,1,parse_declarator());
+			push_AST(parse_declarator());
 			consume_token(')');
 			break;
 		default: parse_error();
@@ -373,39 +770,37 @@ static struct AST* parse_direct_declarator (void){
 
 	while(lookahead(1) == '('){
 		consume_token('('); 
-		param = create_AST("direct_declarator_parameter",0);
+		pbase = begin_AST();
 		
 		if(lookahead(1) == TK_KW_INT || lookahead(1) == TK_KW_CHAR || lookahead(1) == TK_KW_VOID){
-			child = parse_parameter_declaration();
-			param = add_AST(param,1,child);
+			push_AST(parse_parameter_declaration());
 
 			while(lookahead(1) == ','){
 				consume_token(',');
-				child = parse_parameter_declaration();
-				param = add_AST(param,1,child);
+				push_AST(parse_parameter_declaration());
 			}
 
 		}
 
-		ast = add_AST(ast,1,param);
+		push_AST(finish_AST(AST_DIRECT_DECLARATOR_PARAMETER,pbase));
 
 		consume_token(')');
 	}
 
-	return ast;
+	return finish_AST(AST_DIRECT_DECLARATOR,base);
 }
 
 
 // parameter_declaration : type_specifier declarator ;
-static struct AST* parse_parameter_declaration (void){
-	struct AST *child0,*child1;
+static ast_id parse_parameter_declaration (void){
+	ast_id child0,child1;
 	if(lookahead(1) == TK_KW_INT || lookahead(1) == TK_KW_CHAR || lookahead(1) == TK_KW_VOID){
 		child0 = parse_type_specifier();
 		child1 = parse_declarator();
 	}
 	else parse_error();
 
-	struct AST* ast = create_AST("parameter_declaration",2,child0,child1);
+	ast_id ast = create_AST(AST_PARAMETER_DECLARATION,2,child0,child1);
 
 	return ast;
 }
@@ -421,69 +816,68 @@ statement : IDENTIFIER ":" // 注1
           | [ exp ] ";" 
           ;
 */
-static struct AST* parse_statement (void){
-	struct AST* ast = NULL;
-	struct AST* child = NULL;
+static ast_id parse_statement (void){
+	ast_id ast = AST_NONE;
+	ast_id child = AST_NONE;
 	struct token* t;
+	int base = begin_AST();
 
 	if(lookahead(1) == TK_ID && lookahead(2) == ':'){ // label
 		t = eat_token();
-		child = create_leaf("TK_ID",t->lexeme);
-		ast = create_AST("statement_label",1,child);
+		child = create_leaf(AST_ID,t);
+		ast = create_AST(AST_STATEMENT_LABEL,1,child);
 		consume_token(':');
 		return ast;
 	}
 
 	if(expect_exp(lookahead(1))){ // exp
 		child = parse_exp();
-		ast = create_AST("statement_exp",1,child);
+		ast = create_AST(AST_STATEMENT_EXP,1,child);
 		consume_token(';');
 		return ast;
 	}
 
 	switch(lookahead(1)){ // other
 		case ';': // empty exp
-			ast = create_AST("statement_exp",1,create_leaf("exp_empty"," "));
+			ast = create_AST(AST_STATEMENT_EXP,1,create_leaf(AST_EXP_EMPTY,NULL));
 			consume_token(';');
 			break;
 		case '{':
 			ast = parse_compound_statement();
 			break;
 		case TK_KW_IF:
-			ast = create_AST("statement_if",0);
 			consume_token(TK_KW_IF);
 			consume_token('(');
-			ast = add_AST(ast,1,parse_exp());
+			push_AST(parse_exp());
 			consume_token(')');
-			ast = add_AST(ast,1,parse_statement());
+			push_AST(parse_statement());
 			
 			if(lookahead(1) == TK_KW_ELSE){
 				consume_token(TK_KW_ELSE);
-				ast = add_AST(ast,1,parse_statement());
+				push_AST(parse_statement());
 			}
 
+			ast = finish_AST(AST_STATEMENT_IF,base);
 			break;
 		case TK_KW_WHILE:
-			ast = create_AST("statement_while",0);
 			consume_token(TK_KW_WHILE); 
 			consume_token('(');
-			ast = add_AST(ast,1,parse_exp());
+			child = parse_exp();
 			consume_token(')');
-			ast = add_AST(ast,1,parse_statement());
+			ast = create_AST(AST_STATEMENT_WHILE,2,child,parse_statement());
 			break;
 		case TK_KW_GOTO:
-			ast = create_AST("statement_goto",0);
 			consume_token(TK_KW_GOTO);
 			t = eat_token();
-			ast = add_AST(ast,1,create_leaf("TK_ID",t->lexeme));
+			ast = create_AST(AST_STATEMENT_GOTO,1,create_leaf(AST_ID,t));
 			consume_token(';');
 			break;
 		case TK_KW_RETURN:
-			ast = create_AST("statement_return",0);
 			consume_token(TK_KW_RETURN);
 			if(expect_exp(lookahead(1))){
-				ast = add_AST(ast,1,parse_exp());
+				push_AST(parse_exp());
 			}
+			ast = finish_AST(AST_STATEMENT_RETURN,base);
 			consume_token(';');
 			break;
 		default: parse_error();
@@ -494,14 +888,14 @@ static struct AST* parse_statement (void){
 
 
 // compound_statement : "{" (type_specifier declarator ";")* ( statement )* "}" ;
-static struct AST* parse_compound_statement (void){
-	struct AST* ast = create_AST("compound_statement",0);
+static ast_id parse_compound_statement (void){
+	int base = begin_AST();
 
 	consume_token('{'); 
 
 	while(lookahead(1) == TK_KW_INT || lookahead(1) == TK_KW_CHAR || lookahead(1) == TK_KW_VOID){ // decl
-		ast = add_AST(ast,1,parse_type_specifier());
-		ast = add_AST(ast,1,parse_declarator());
+		push_AST(parse_type_specifier());
+		push_AST(parse_declarator());
 		consume_token(';');
 	}
 
@@ -510,20 +904,20 @@ static struct AST* parse_compound_statement (void){
 		|| lookahead(1) == TK_KW_GOTO || lookahead(1) == TK_KW_RETURN
 		|| expect_exp(lookahead(1))
 	){ // stmt
-		ast = add_AST(ast,1,parse_statement());
+		push_AST(parse_statement());
 	}
 
 	consume_token('}');
 
-	return ast;
+	return finish_AST(AST_COMPOUND_STATEMENT,base);
 }
 
 // exp : exp9 ;
-static struct AST* parse_exp (void){
-	struct AST* ast = create_AST("exp",0);
+static ast_id parse_exp (void){
+	ast_id ast = AST_NONE;
 	
 	if(expect_exp(lookahead(1))){
-		ast = add_AST(ast,1,parse_exp9());
+		ast = create_AST(AST_EXP,1,parse_binary(9));
 	}
 	else parse_error();
 
@@ -531,251 +925,134 @@ static struct AST* parse_exp (void){
 }
 
 
-// exp9 : exp8 ( "=" exp8 )* ;
-static struct AST* parse_exp9 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp8();
-	}
-	else parse_error();
-
-	if(lookahead(1) == '='){
-		ast = create_AST("exp9",1,tmp);
-
-		while(lookahead(1) == '='){
-			consume_token('=');
-			ast = add_AST(ast,1,parse_exp8());
-		}
-
-		return ast;
-	}
-	
-	return tmp;
-}
-
-// exp8 : exp7 ( "||" exp7 )* ;
-static struct AST* parse_exp8 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp7();
-	}
-	else parse_error();
-
-	if(lookahead(1) == TK_OP_OR){
-		ast = create_AST("exp8",1,tmp);
-
-		while(lookahead(1) == TK_OP_OR){
-			consume_token(TK_OP_OR);
-			ast = add_AST(ast,1,parse_exp7());
-		}
-
-		return ast;
-	}
-	
-	return tmp;
-}
-
-// exp7 : exp6 ( "&&" exp6 )* ;
-static struct AST* parse_exp7 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp6();
-	}
-	else parse_error();
-
-	if(lookahead(1) == TK_OP_AND){
-		ast = create_AST("exp7",1,tmp);
-
-		while(lookahead(1) == TK_OP_AND){
-			consume_token(TK_OP_AND);
-			ast = add_AST(ast,1,parse_exp6());
-		}
-
-		return ast;
-	}
-	
-	return tmp;
-}
-
-// exp6 : exp5 ( "==" exp5 )* ;
-static struct AST* parse_exp6 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp5();
-	}
-	else parse_error();
-
-	if(lookahead(1) == TK_OP_EQ){
-		ast = create_AST("exp6",1,tmp);
-
-		while(lookahead(1) == TK_OP_EQ){
-			consume_token(TK_OP_EQ);
-			ast = add_AST(ast,1,parse_exp5());
-		}
-
-		return ast;
-	}
-	
-	return tmp;
-}
-
-// exp5 : exp4 ( "<" exp4 )* ;
-static struct AST* parse_exp5 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp4();
-	}
-	else parse_error();
-
-	if(lookahead(1) == '<'){
-		ast = create_AST("exp5",1,tmp);
-
-		while(lookahead(1) == '<'){
-			consume_token('<');
-			ast = add_AST(ast,1,parse_exp4());
-		}
+/*
+exp9 : exp8 ( "=" exp8 )* ;
+exp8 : exp7 ( "||" exp7 )* ;
+exp7 : exp6 ( "&&" exp6 )* ;
+exp6 : exp5 ( "==" exp5 )* ;
+exp5 : exp4 ( "<" exp4 )* ;
+exp4 : exp3 ( "+" exp3 | "-" exp3 )* ;
+exp3 : exp2 ( "*" exp2 | "/" exp2 )* ;
+
+exp9 から exp3 は下の表を使って parse_binary でまとめて読む
+どのレベルも左結合で、同じレベルの並びは1つのノードにする (演算子が無ければノードを作らない)
+*/
+static const struct binop {
+	unsigned char level;   // 0 なら二項演算子ではない (小さいほど強く結合する)
+	unsigned char kind;    // まとめたノードの種類
+	unsigned char keep;    // 演算子の葉を子に残すか (exp4,exp3 は unparse で使う)
+} binop_table[128] = {
+	['=']       = { 9, AST_EXP9, 0 },
+	[TK_OP_OR]  = { 8, AST_EXP8, 0 },
+	[TK_OP_AND] = { 7, AST_EXP7, 0 },
+	[TK_OP_EQ]  = { 6, AST_EXP6, 0 },
+	['<']       = { 5, AST_EXP5, 0 },
+	['+']       = { 4, AST_EXP4, 1 }, ['-'] = { 4, AST_EXP4, 1 },
+	['*']       = { 3, AST_EXP3, 1 }, ['/'] = { 3, AST_EXP3, 1 },
+};
 
-		return ast;
-	}
-	
-	return tmp;
+static int binop_level(enum token_kind k){
+	return (unsigned)k < 128 ? binop_table[k].level : 0;
 }
 
-// exp4 : exp3 ( "+" exp3 | "-" exp3 )* ;
-static struct AST* parse_exp4 (void){
-	struct AST* ast;
-	struct AST *tmp;
+// level 以下の演算子だけを読む (exp<level> を1つ読むのと同じ)
+static ast_id parse_binary(int level){
+	ast_id ast;
+	int l;
+	enum token_kind k;
 
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp3();
-	}
-	else parse_error();
+	if(level < 3) return parse_exp2();
+	if(!expect_exp(lookahead(1))) parse_error();
 
-	enum token_kind k = lookahead(1);
-	if(k == '+' || k == '-'){
-		ast = create_AST("exp4",1,tmp);
+	ast = parse_exp2();
+	while((l = binop_level(lookahead(1))) != 0 && l <= level){
+		int base = begin_AST();
+		enum ast_kind kind = binop_table[lookahead(1)].kind;
+		push_AST(ast);
 
-		for(; k == '+' || k == '-'; k = lookahead(1)){
-			consume_and_add(&ast,k);
-			ast = add_AST(ast,1,parse_exp3());
+		for(k = lookahead(1); binop_level(k) == l; k = lookahead(1)){
+			if(binop_table[k].keep) consume_and_push(k);
+			else consume_token(k);
+			push_AST(parse_binary(l - 1));
 		}
 
-		return ast;
-	}
-	
-	return tmp;
-}
-
-// exp3 : exp2 ( "*" exp2 | "/" exp2 )* ;
-static struct AST* parse_exp3 (void){
-	struct AST* ast;
-	struct AST *tmp;
-
-	if(expect_exp(lookahead(1))){
-		tmp = parse_exp2();
+		ast = finish_AST(kind,base);
 	}
-	else parse_error();
-
-	enum token_kind k = lookahead(1);
-	if(k == '*' || k == '/'){
-		ast = create_AST("exp3",1,tmp);
 
-		for(; k == '*' || k == '/'; k = lookahead(1)){
-			consume_and_add(&ast,k);
-			ast = add_AST(ast,1,parse_exp2());
-		}
-
-		return ast;
-	}
-	
-	return tmp;
+	return ast;
 }
 
-
 // exp2 : ( "&" | "*" | "+" | "-" | "!" )* exp1 ;
-static struct AST* parse_exp2 (void){
-	struct AST* ast=NULL;
+static ast_id parse_exp2 (void){
+	ast_id ast=AST_NONE;
 	enum token_kind k;
+	int base = begin_AST();
 
-	k = lookahead(1);
-	if(k == '&' || k == '*' || k == '+' || k == '-' || k == '!'){
-		ast = create_AST("exp2",0);
-
-		for(;k == '&' || k == '*' || k == '+' || k == '-' || k == '!';k = lookahead(1)){
-			consume_and_add(&ast,k);
-		}
+	for(k = lookahead(1);k == '&' || k == '*' || k == '+' || k == '-' || k == '!';k = lookahead(1)){
+		consume_and_push(k);
 	}
 
 	if(expect_exp1(lookahead(1))){
-		if(ast == NULL) ast = parse_exp1();
-		else ast = add_AST(ast,1,parse_exp1());
+		ast = parse_exp1();
 	}
 
-	return ast;
+	if(cur->scratch_num == base) return ast;
+
+	if(ast != AST_NONE) push_AST(ast);
+	return finish_AST(AST_EXP2,base);
 }
 
 // exp1 : primary ( "(" argument_expression_list ")" )* ;
-static struct AST* parse_exp1(void){
-	struct AST* ast;
-	struct AST *tmp;
+static ast_id parse_exp1(void){
+	ast_id tmp = AST_NONE;
 
 	if(expect_primary(lookahead(1))){
 		tmp = parse_primary();
 	}
 
 	if(lookahead(1) == '('){
-		ast = create_AST("exp1",1,tmp);
+		int base = begin_AST();
+		push_AST(tmp);
 
 		while(lookahead(1) == '('){
 			consume_token('(');
 			
-			ast = add_AST(ast,1,parse_argument_expression_list());
+			push_AST(parse_argument_expression_list());
 
 			consume_token(')');
 		}
 
-		return ast;
+		return finish_AST(AST_EXP1,base);
 	}
 
 	return tmp;
 }
 
 // primary : INTEGER | CHARACTER | STRING | IDENTIFIER | "(" exp ")" ;
-static struct AST* parse_primary(void){
-	struct AST* ast;
+static ast_id parse_primary(void){
+	ast_id ast;
 	struct token* t;
 
 	switch(lookahead(1)){
 		case TK_INT:
 			t = eat_token();
-			ast = create_leaf("TK_INT",t->lexeme);
+			ast = create_leaf(AST_INT,t);
 			break;
 		case TK_CHAR:
 			t = eat_token();
-			ast = create_leaf("TK_CHAR",t->lexeme);
+			ast = create_leaf(AST_CHAR,t);
 			break;
 		case TK_STRING:
 			t = eat_token();
-			ast = create_leaf("TK_STRING",t->lexeme);
+			ast = create_leaf(AST_STRING,t);
 			break;
 		case TK_ID:
 			t = eat_token();
-			ast = create_leaf("TK_ID",t->lexeme);
+			ast = create_leaf(AST_ID,t);
 			break;
 		case '(':
-			ast = create_AST("primary",0);
 			consume_token('(');
-			ast = add_AST(ast,1,parse_exp());
+			ast = create_AST(AST_PRIMARY,1,parse_exp());
 			consume_token(')');
 			break;
 		default: parse_error();
@@ -786,449 +1063,1022 @@ static struct AST* parse_primary(void){
 
 
 // argument_expression_list : [ exp ( "," exp )* ] ;
-static struct AST* parse_argument_expression_list(void){
-	struct AST* ast = create_AST("argument_expression_list",0);
+static ast_id parse_argument_expression_list(void){
+	int base = begin_AST();
 	if(expect_exp(lookahead(1))){
-		ast = add_AST(ast,1,parse_exp());
+		push_AST(parse_exp());
 
 		while(lookahead(1) == ','){
 			consume_token(',');
-			ast = add_AST(ast,1,parse_exp());
+			push_AST(parse_exp());
 		}
 	}
 	else{
-		ast = add_AST(ast,1,create_AST("exp",1,create_leaf("exp_empty"," ")));
+		push_AST(create_AST(AST_EXP,1,create_leaf(AST_EXP_EMPTY,NULL)));
 	}
 
 
-	return ast;
+	return finish_AST(AST_ARGUMENT_EXPRESSION_LIST,base);
 }
 
-// translation_unit: ( type_specifier declarator ( ";" | compound_statement ))*
-static struct AST*
-parse_translation_unit (void)
+// 宣言子で宣言される名前 (最初の識別子)
+static char*
+declarator_name (ast_id ast)
 {
-    struct AST *ast, *ast1, *ast2, *ast3;
-
-    ast = create_AST ("translation_unit", 0);
-    while (1) {
-        switch (lookahead (1)) {
-        case TK_KW_INT: case TK_KW_CHAR: case TK_KW_VOID:
-            ast1 = parse_type_specifier ();
-            ast2 = parse_declarator ();
-            switch (lookahead (1)) {
-            case ';':
-                consume_token (';');
-				ast = add_AST(ast,1,create_AST("translation_unit_element", 2, ast1, ast2));
-                break;
-            case '{':
-                ast3 = parse_compound_statement ();
-				ast = add_AST(ast,1,create_AST("translation_unit_element", 3, ast1, ast2 , ast3));
-                break;
-            default:
-                parse_error ();
-                break;
-            }
-            break;
-        default:
-            goto loop_exit;
-        }
+    int base = cur->walk_num;
+    char *name = NULL;
+    walk_push (W_NODE, ast, 0);
+    while (name == NULL && cur->walk_num > base) {
+        ast = cur->walk [--cur->walk_num].ast;
+        if (ast == AST_NONE) continue;
+        if (ast_node (ast)->kind == AST_ID) name = ast_lexeme (ast);
+        for (int i = ast_node (ast)->num_child; i-- > 0; )
+            walk_push (W_NODE, ast_children (ast) [i], 0);
     }
-loop_exit:
-    return ast;
+    cur->walk_num = base;
+    return name;
 }
 
-
 /* ------------------------------------------------------- */
+/*
+ * --stack-parse : 上の再帰下降と同じ木とエラーを、C のスタックを使わずに作る
+ * 各 parse_* 関数の途中の位置を状態にして、呼び出しはヒープ上の pframe に積む
+ * (入れ子がどれだけ深くても再帰しない)
+ */
+enum pstate {
+	P_DONE,                                          // run_parser に戻る
+	P_DECL, P_DECL_END,                              // declarator
+	P_DDECL, P_DDECL_INNER, P_DDECL_PARAMS, P_DDECL_PARAM, P_DDECL_PARAM_END, // direct_declarator
+	P_PARAM, P_PARAM_END,                            // parameter_declaration
+	P_STMT, P_STMT_EXP, P_IF_COND, P_IF_THEN, P_IF_ELSE, P_WHILE_COND, P_WHILE_END, P_RETURN_END, // statement
+	P_COMPOUND, P_COMPOUND_DECL, P_COMPOUND_DECL_END, P_COMPOUND_STMT, P_COMPOUND_STMT_END, // compound_statement
+	P_EXP, P_EXP_END,                                // exp
+	P_BINARY, P_BINARY_LOOP, P_BINARY_OPS, P_BINARY_OPS_END, // exp9..exp3
+	P_EXP2, P_EXP2_END,
+	P_EXP1, P_EXP1_POST, P_EXP1_CALL, P_EXP1_CALL_END,
+	P_PRIMARY, P_PRIMARY_END,
+	P_ARGS, P_ARGS_NEXT,                             // argument_expression_list
+};
 
-// 字句解析
+struct pframe {
+	enum pstate state;   // 戻ってきたときに続ける位置
+	int base;            // begin_AST の位置
+	int aux;             // 関数ごとの作業用 (子の ast_id、parameter の base、演算子)
+	int level;           // parse_binary の引数
+};
 
-static char*
-map_file (char *filename)
-{
-    struct stat sbuf;
-    char *ptr;
+// 今の関数から next を呼び、戻ったら ret から続ける
+static struct pframe* pcall(enum pstate ret,enum pstate next,int level){
+	cur->pstack[cur->pstack_num - 1].state = ret;
+	cur->pstack = grow_array(cur->pstack,&cur->pstack_alloced,cur->pstack_num + 1,sizeof(struct pframe),64);
+	struct pframe *f = &cur->pstack[cur->pstack_num++];
+	f->state = next;
+	f->base = begin_AST();
+	f->aux = 0;
+	f->level = level;
+	return f;
+}
 
-    int fd = open (filename, O_RDWR);
-    if (fd == -1) {
-        perror ("open");
-        exit (1);
-    }
+static int is_type_specifier(enum token_kind k){
+	return k == TK_KW_INT || k == TK_KW_CHAR || k == TK_KW_VOID;
+}
+
+static int expect_statement(enum token_kind k){
+	return k == '{' || k == ';' || k == TK_KW_IF || k == TK_KW_WHILE
+		|| k == TK_KW_GOTO || k == TK_KW_RETURN || expect_exp(k);
+}
+
+static ast_id run_parser(enum pstate entry){
+	int bottom = cur->pstack_num;
+	ast_id val = AST_NONE; // 最後に戻った関数の値
+	struct pframe *f;
+	struct token* t;
+	enum token_kind k;
+	int l;
+
+	cur->pstack = grow_array(cur->pstack,&cur->pstack_alloced,cur->pstack_num + 1,sizeof(struct pframe),64);
+	cur->pstack[cur->pstack_num++].state = P_DONE;
+	f = pcall(P_DONE,entry,0);
+
+#define RETURN(v) { val = (v); cur->pstack_num--; f = &cur->pstack[cur->pstack_num - 1]; continue; }
+#define CALL(ret,st,lv) { f = pcall(ret,st,lv); continue; }
+#define JUMP(st) { f->state = (st); continue; }
+
+	for(;;){
+		switch(f->state){
+		case P_DONE:
+			cur->pstack_num = bottom;
+			return val;
+
+		// declarator : ( "*" )* direct_declarator ;
+		case P_DECL:
+			while(lookahead(1) == '*') consume_and_push('*');
+			k = lookahead(1);
+			if(k != TK_ID && k != '(') parse_error();
+			CALL(P_DECL_END,P_DDECL,0);
+		case P_DECL_END:
+			if(cur->scratch_num == f->base) RETURN(val);
+			push_AST(val);
+			RETURN(finish_AST(AST_DECLARATOR,f->base));
+
+		// direct_declarator : ( IDENTIFIER | "(" declarator ")" ) ( "(" [ parameter_declaration ( "," parameter_declaration )* ] ")" )* ;
+		case P_DDECL:
+			switch(lookahead(1)){
+				case TK_ID:
+					t = eat_token();
+					push_AST(create_leaf(AST_ID,t));
+					JUMP(P_DDECL_PARAMS);
+				case '(':
+					consume_token('(');
+					CALL(P_DDECL_INNER,P_DECL,0);
+				default: parse_error();
+			}
+		case P_DDECL_INNER:
+			push_AST(val);
+			consume_token(')');
+			JUMP(P_DDECL_PARAMS);
+		case P_DDECL_PARAMS:
+			if(lookahead(1) != '(') RETURN(finish_AST(AST_DIRECT_DECLARATOR,f->base));
+			consume_token('(');
+			f->aux = begin_AST();
+			if(is_type_specifier(lookahead(1))) CALL(P_DDECL_PARAM,P_PARAM,0);
+			JUMP(P_DDECL_PARAM_END);
+		case P_DDECL_PARAM:
+			push_AST(val);
+			if(lookahead(1) == ','){
+				consume_token(',');
+				CALL(P_DDECL_PARAM,P_PARAM,0);
+			}
+			JUMP(P_DDECL_PARAM_END);
+		case P_DDECL_PARAM_END:
+			push_AST(finish_AST(AST_DIRECT_DECLARATOR_PARAMETER,f->aux));
+			consume_token(')');
+			JUMP(P_DDECL_PARAMS);
+
+		// parameter_declaration : type_specifier declarator ;
+		case P_PARAM:
+			if(!is_type_specifier(lookahead(1))) parse_error();
+			f->aux = parse_type_specifier();
+			CALL(P_PARAM_END,P_DECL,0);
+		case P_PARAM_END:
+			RETURN(create_AST(AST_PARAMETER_DECLARATION,2,(ast_id)f->aux,val));
+
+		// statement (parse_statement の注を参照)
+		case P_STMT:
+			if(lookahead(1) == TK_ID && lookahead(2) == ':'){
+				t = eat_token();
+				val = create_AST(AST_STATEMENT_LABEL,1,create_leaf(AST_ID,t));
+				consume_token(':');
+				RETURN(val);
+			}
+			if(expect_exp(lookahead(1))) CALL(P_STMT_EXP,P_EXP,0);
+			switch(lookahead(1)){
+				case ';':
+					val = create_AST(AST_STATEMENT_EXP,1,create_leaf(AST_EXP_EMPTY,NULL));
+					consume_token(';');
+					RETURN(val);
+				case '{':
+					JUMP(P_COMPOUND);
+				case TK_KW_IF:
+					consume_token(TK_KW_IF);
+					consume_token('(');
+					CALL(P_IF_COND,P_EXP,0);
+				case TK_KW_WHILE:
+					consume_token(TK_KW_WHILE);
+					consume_token('(');
+					CALL(P_WHILE_COND,P_EXP,0);
+				case TK_KW_GOTO:
+					consume_token(TK_KW_GOTO);
+					t = eat_token();
+					val = create_AST(AST_STATEMENT_GOTO,1,create_leaf(AST_ID,t));
+					consume_token(';');
+					RETURN(val);
+				case TK_KW_RETURN:
+					consume_token(TK_KW_RETURN);
+					if(expect_exp(lookahead(1))) CALL(P_RETURN_END,P_EXP,0);
+					val = AST_NONE;
+					JUMP(P_RETURN_END);
+				default: parse_error();
+			}
+		case P_STMT_EXP:
+			val = create_AST(AST_STATEMENT_EXP,1,val);
+			consume_token(';');
+			RETURN(val);
+		case P_IF_COND:
+			push_AST(val);
+			consume_token(')');
+			CALL(P_IF_THEN,P_STMT,0);
+		case P_IF_THEN:
+			push_AST(val);
+			if(lookahead(1) == TK_KW_ELSE){
+				consume_token(TK_KW_ELSE);
+				CALL(P_IF_ELSE,P_STMT,0);
+			}
+			RETURN(finish_AST(AST_STATEMENT_IF,f->base));
+		case P_IF_ELSE:
+			push_AST(val);
+			RETURN(finish_AST(AST_STATEMENT_IF,f->base));
+		case P_WHILE_COND:
+			f->aux = val;
+			consume_token(')');
+			CALL(P_WHILE_END,P_STMT,0);
+		case P_WHILE_END:
+			RETURN(create_AST(AST_STATEMENT_WHILE,2,(ast_id)f->aux,val));
+		case P_RETURN_END:
+			if(val != AST_NONE) push_AST(val);
+			val = finish_AST(AST_STATEMENT_RETURN,f->base);
+			consume_token(';');
+			RETURN(val);
+
+		// compound_statement : "{" (type_specifier declarator ";")* ( statement )* "}" ;
+		case P_COMPOUND:
+			consume_token('{');
+			JUMP(P_COMPOUND_DECL);
+		case P_COMPOUND_DECL:
+			if(!is_type_specifier(lookahead(1))) JUMP(P_COMPOUND_STMT);
+			push_AST(parse_type_specifier());
+			CALL(P_COMPOUND_DECL_END,P_DECL,0);
+		case P_COMPOUND_DECL_END:
+			push_AST(val);
+			consume_token(';');
+			JUMP(P_COMPOUND_DECL);
+		case P_COMPOUND_STMT:
+			if(expect_statement(lookahead(1))) CALL(P_COMPOUND_STMT_END,P_STMT,0);
+			consume_token('}');
+			RETURN(finish_AST(AST_COMPOUND_STATEMENT,f->base));
+		case P_COMPOUND_STMT_END:
+			push_AST(val);
+			JUMP(P_COMPOUND_STMT);
+
+		// exp : exp9 ;
+		case P_EXP:
+			if(!expect_exp(lookahead(1))) parse_error();
+			CALL(P_EXP_END,P_BINARY,9);
+		case P_EXP_END:
+			RETURN(create_AST(AST_EXP,1,val));
+
+		// exp9 .. exp3 (parse_binary と同じ、aux はそのレベルの最初の演算子)
+		case P_BINARY:
+			if(f->level < 3) JUMP(P_EXP2);
+			if(!expect_exp(lookahead(1))) parse_error();
+			CALL(P_BINARY_LOOP,P_EXP2,0);
+		case P_BINARY_LOOP:
+			l = binop_level(lookahead(1));
+			if(l == 0 || l > f->level) RETURN(val);
+			f->base = begin_AST();
+			f->aux = lookahead(1);
+			push_AST(val);
+			JUMP(P_BINARY_OPS);
+		case P_BINARY_OPS:
+			k = lookahead(1);
+			l = binop_table[f->aux].level;
+			if(binop_level(k) != l){
+				val = finish_AST(binop_table[f->aux].kind,f->base);
+				JUMP(P_BINARY_LOOP);
+			}
+			if(binop_table[k].keep) consume_and_push(k);
+			else consume_token(k);
+			CALL(P_BINARY_OPS_END,P_BINARY,l - 1);
+		case P_BINARY_OPS_END:
+			push_AST(val);
+			JUMP(P_BINARY_OPS);
+
+		// exp2 : ( "&" | "*" | "+" | "-" | "!" )* exp1 ;
+		case P_EXP2:
+			for(k = lookahead(1);k == '&' || k == '*' || k == '+' || k == '-' || k == '!';k = lookahead(1)){
+				consume_and_push(k);
+			}
+			if(expect_exp1(lookahead(1))) CALL(P_EXP2_END,P_EXP1,0);
+			val = AST_NONE;
+			JUMP(P_EXP2_END);
+		case P_EXP2_END:
+			if(cur->scratch_num == f->base) RETURN(val);
+			if(val != AST_NONE) push_AST(val);
+			RETURN(finish_AST(AST_EXP2,f->base));
+
+		// exp1 : primary ( "(" argument_expression_list ")" )* ;
+		case P_EXP1:
+			CALL(P_EXP1_POST,P_PRIMARY,0);
+		case P_EXP1_POST:
+			if(lookahead(1) != '(') RETURN(val);
+			f->base = begin_AST();
+			push_AST(val);
+			JUMP(P_EXP1_CALL);
+		case P_EXP1_CALL:
+			if(lookahead(1) != '(') RETURN(finish_AST(AST_EXP1,f->base));
+			consume_token('(');
+			CALL(P_EXP1_CALL_END,P_ARGS,0);
+		case P_EXP1_CALL_END:
+			push_AST(val);
+			consume_token(')');
+			JUMP(P_EXP1_CALL);
+
+		// primary : INTEGER | CHARACTER | STRING | IDENTIFIER | "(" exp ")" ;
+		case P_PRIMARY:
+			switch(lookahead(1)){
+				case TK_INT:    t = eat_token(); RETURN(create_leaf(AST_INT,t));
+				case TK_CHAR:   t = eat_token(); RETURN(create_leaf(AST_CHAR,t));
+				case TK_STRING: t = eat_token(); RETURN(create_leaf(AST_STRING,t));
+				case TK_ID:     t = eat_token(); RETURN(create_leaf(AST_ID,t));
+				case '(':
+					consume_token('(');
+					CALL(P_PRIMARY_END,P_EXP,0);
+				default: parse_error();
+			}
+		case P_PRIMARY_END:
+			val = create_AST(AST_PRIMARY,1,val);
+			consume_token(')');
+			RETURN(val);
+
+		// argument_expression_list : [ exp ( "," exp )* ] ;
+		case P_ARGS:
+			if(expect_exp(lookahead(1))) CALL(P_ARGS_NEXT,P_EXP,0);
+			push_AST(create_AST(AST_EXP,1,create_leaf(AST_EXP_EMPTY,NULL)));
+			RETURN(finish_AST(AST_ARGUMENT_EXPRESSION_LIST,f->base));
+		case P_ARGS_NEXT:
+			push_AST(val);
+			if(lookahead(1) == ','){
+				consume_token(',');
+				CALL(P_ARGS_NEXT,P_EXP,0);
+			}
+			RETURN(finish_AST(AST_ARGUMENT_EXPRESSION_LIST,f->base));
+		}
+	}
+
+#undef RETURN
+#undef CALL
+#undef JUMP
+}
+
+// translation_unit: ( type_specifier declarator ( ";" | compound_statement ))*
+static ast_id parse_translation_unit (void)
+{
+    ast_id ast1, ast2, ast3;
+    int base = begin_AST ();
+
+    long long t0 = 0;
+
+    while (1) {
+        switch (lookahead (1)) {
+        case TK_KW_INT: case TK_KW_CHAR: case TK_KW_VOID:
+            if (opt_trace) t0 = trace_now ();
+            ast1 = parse_type_specifier ();
+            ast2 = opt_stack_parse ? run_parser (P_DECL) : parse_declarator ();
+            switch (lookahead (1)) {
+            case ';':
+                consume_token (';');
+				push_AST(create_AST(AST_TRANSLATION_UNIT_ELEMENT, 2, ast1, ast2));
+                break;
+            case '{':
+                ast3 = opt_stack_parse ? run_parser (P_COMPOUND) : parse_compound_statement ();
+				push_AST(create_AST(AST_TRANSLATION_UNIT_ELEMENT, 3, ast1, ast2 , ast3));
+                break;
+            default:
+                parse_error ();
+                break;
+            }
+            if (opt_trace)
+                trace_add (&cur->trace, "translation_unit_element", declarator_name (ast2), t0, cur->trace_tid);
+            break;
+        default:
+            goto loop_exit;
+        }
+    }
+loop_exit:
+    return finish_AST (AST_TRANSLATION_UNIT, base);
+}
 
-    fstat (fd, &sbuf);
-#if 0
-    printf ("file size = %lld\n", sbuf.st_size);
-#endif
 
-    ptr = mmap (NULL, sbuf.st_size + 1, // +1 for '\0'
-                PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+/* ------------------------------------------------------- */
+
+// 字句解析
+
+// 読み込み専用でちょうどファイルの長さだけマップする (終端の '\0' は付けない)
+static char*
+map_file (char *filename, int *size)
+{
+    struct stat sbuf;
+    char *ptr;
+
+    int fd = open (filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf (cur->err, "%s: open: %s\n", filename, strerror (errno));
+        longjmp (cur->error, 1);
+    }
+
+    fstat (fd, &sbuf);
+#if 0
+    printf ("file size = %lld\n", sbuf.st_size);
+#endif
+
+    if (sbuf.st_size == 0) { // 長さ 0 は mmap できない
+        close (fd);
+        *size = 0;
+        build_line_index ("", 0);
+        return "";
+    }
+
+    ptr = mmap (NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (ptr == MAP_FAILED) {
-        perror ("mmap");
-        exit (1);
+        fprintf (cur->err, "%s: mmap: %s\n", filename, strerror (errno));
+        close (fd);
+        longjmp (cur->error, 1);
     }
-    ptr [sbuf.st_size] = '\0';
+    close (fd);
+    madvise (ptr, sbuf.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (opt_huge_pages && sbuf.st_size >= HUGE_PAGE_MIN)
+        madvise (ptr, sbuf.st_size, MADV_HUGEPAGE);
+#endif
+    *size = sbuf.st_size;
+    build_line_index (ptr, sbuf.st_size);
     return ptr;
 }
 
+static void
+unmap_file (char *ptr, int size)
+{
+    if (size > 0) munmap (ptr, size);
+}
+
+static void
+add_line (int offset)
+{
+    if (cur->num_lines == cur->line_alloced) {
+        cur->line_alloced = cur->line_alloced ? cur->line_alloced * 2 : 1024;
+        cur->line_begin = xrealloc (cur->line_begin, sizeof (int) * cur->line_alloced);
+    }
+    cur->line_begin [cur->num_lines++] = offset;
+}
+
+// 改行位置の表 (字句解析中に行を数えないで済むように、マップ時に一度だけ作る)
+static void
+build_line_index (char *ptr, size_t size)
+{
+    size_t i = 0;
+    cur->num_lines = 0;
+    add_line (0);
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8 ('\n');
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (ptr + i));
+        unsigned mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, nl));
+        while (mask) {
+            add_line (i + __builtin_ctz (mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (ptr [i] == '\n') add_line (i + 1);
+    }
+}
+
+// オフセットから行と桁 (どちらも1始まり) を二分探索で求める
+static void
+offset_to_linecol (int offset, int *line, int *col)
+{
+    int lo = 0, hi = cur->num_lines - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (cur->line_begin [mid] <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    *line = lo + 1;
+    *col  = offset - cur->line_begin [lo] + 1;
+}
+
 static void*
 copy_string_region_int (char *s, int start, int end)
 {
     int size = end - start;
-    char *buf = malloc (size + 1); // +1 for '\0'
+    char *buf = xmalloc (size + 1); // +1 for '\0'
     memcpy (buf, s+start, size);
     buf [size] = '\0';
     return buf;
 }
 
 static int
-set_token_int (char *ptr, int begin, int end, int kind, int off)
+set_token_int (struct token *t, char *ptr, int begin, int end, int kind, int off)
 {
-    assert (tokens_index < MAX_TOKENS);
-    struct token *token_p = &tokens [tokens_index++];
     assert (begin == 0);
-    token_p->kind = kind;
-    token_p->offset_begin = off + begin;
-    token_p->offset_end   = off + end;
-    token_p->lexeme = copy_string_region_int (ptr + off, begin, end);
+    t->kind = kind;
+    t->offset_begin = off + begin;
+    t->offset_end   = off + end;
+    t->lexeme = copy_string_region_int (ptr + off, begin, end);
 #if 0
-    printf ("topen_p->lexeme = |%s|\n", token_p->lexeme);
+    printf ("topen_p->lexeme = |%s|\n", t->lexeme);
 #endif
     return off + end;
 }
 
-static void create_tokens(char* ptr){
-	Lexer lex = compileLex(ptr,token_table,sizeof(token_table)/sizeof(SymbolElement));
+// --lex-stats の表示用
+static const char* tag_name(int tag){
+	switch(tag){
+		case TK_ERROR:     return "TK_ERROR";
+		case TK_COM_BEGIN: return "TK_COM_BEGIN";
+		case TK_COM_END:   return "TK_COM_END";
+	}
+	if(tag >= 0 && tag < (int)(sizeof(token_kind_name)/sizeof(char*))) return token_kind_name[tag];
+	return NULL;
+}
 
+// 空白とコメントを読み飛ばして字句を1つ読む、入力の終わりなら 0 を返す
+// scan はこれまでに字句解析器が読んだ最も先のオフセット
+static int lex_token(Lexer* lex,char* ptr,int* offset,int* scan,struct token* t){
 	Match m;
-	int offset = 0;
 
-	while(nextMatch(&lex,&m)){
+	while(nextMatch(lex,&m)){
 
 		//printf("[ tag:%d %.*s]\n",m.tag,m.num,m.str);
+		if(*offset + m.num + m.look - 1 > *scan) *scan = *offset + m.num + m.look - 1;
 
 		if(m.tag == -1){ // unknown character
-			printf("lexical error\n");
-			freeLex(&lex);
-			exit(1);//goto END;
+			diag_at(cur->out,*offset);
+			fprintf(cur->out,"lexical error\n");
+			longjmp(cur->error,1);
 		}
 
 		else if(m.tag == TK_UNUSED){ // white space
-			offset += m.num;
+			*offset += m.num;
 			continue;
 		}
 
 		else if(m.tag == TK_COM_BEGIN){ // comment
-			offset += m.num;
-			while(nextMatch(&lex,&m)){
-				offset += m.num;
+			*offset += m.num;
+			while(nextMatch(lex,&m)){
+				if(*offset + m.num + m.look - 1 > *scan) *scan = *offset + m.num + m.look - 1;
+				*offset += m.num;
 				if(m.tag == TK_COM_END) break;
 			}
 			continue;
 		}
 
-		//printf("[ tag:%d %.*s]\n",m.tag,m.num,ptr+offset);
-		offset = set_token_int(ptr , 0 , m.num , m.tag , offset);
+		//printf("[ tag:%d %.*s]\n",m.tag,m.num,ptr+*offset);
+		*offset = set_token_int(t, ptr, 0, m.num, m.tag, *offset);
+		t->offset_scan = *scan;
+		return 1;
+	}
+
+	return 0;
+}
+
+// tokens[0..n) と終端の空の字句の分を確保する (伸ばした所は 0 で埋める)
+static void reserve_tokens(int n){
+	int old = cur->tokens_alloced;
+	cur->tokens = grow_array(cur->tokens,&cur->tokens_alloced,n + 2,sizeof(struct token),1024);
+	memset(&cur->tokens[old],0,sizeof(struct token) * (cur->tokens_alloced - old));
+}
+
+static void create_tokens(char* ptr,int size){
+	Lexer* lex = &cur->lex;
+#if LEX_STATS
+	if(opt_lex_stats || opt_lex_dot) enableLexStats(lex); // --lex-dot の色付けにも使う
+#endif
+
+	int offset = 0, scan = -1;
+
+	resetLex(lex,ptr,size);
+	for(;;){
+		reserve_tokens(cur->tokens_index + 1);
+		if(!lex_token(lex,ptr,&offset,&scan,&cur->tokens[cur->tokens_index])) break;
+		cur->tokens_index++;
 	}
 
 	// success tokenize.
 // END:
-	freeLex(&lex);
+#if LEX_STATS
+	if(opt_lex_stats) printLexStats(getLexStats(lex),tag_name,cur->err);
+#else
+	if(opt_lex_stats) fprintf(cur->err,"lex stats: not compiled in (LEX_STATS=0)\n");
+#endif
+
+	// 字句解析器のオートマトン (実行回数のヒートマップ付き)
+	if(opt_lex_dot){
+		FILE* fp = fopen(opt_lex_dot,"w");
+		if(fp == NULL) perror(opt_lex_dot);
+		else {
+			printLexDot(lex->rules,lex->stats,tag_name,fp);
+			fclose(fp);
+		}
+	}
+}
+
+// 編集で offset から del 文字を消して ins を入れたときの改行表の更新
+static void update_line_index(int offset,int del,char* ins){
+	int delta = strlen(ins) - del;
+	int a, b, n = 0, i;
+
+	for(char* p = ins;*p;p++) if(*p == '\n') n++;
+	for(a = cur->num_lines;a > 0 && cur->line_begin[a-1] > offset;a--) ;
+	for(b = a;b < cur->num_lines && cur->line_begin[b] <= offset + del;b++) ;
+
+	if(cur->num_lines - (b - a) + n > cur->line_alloced){
+		cur->line_alloced = (cur->num_lines - (b - a) + n) * 2;
+		cur->line_begin = xrealloc(cur->line_begin,sizeof(int) * cur->line_alloced);
+	}
+	memmove(&cur->line_begin[a + n],&cur->line_begin[b],sizeof(int) * (cur->num_lines - b));
+	cur->num_lines += n - (b - a);
+	for(i = a + n;i < cur->num_lines;i++) cur->line_begin[i] += delta;
+	for(char* p = ins;*p;p++) if(*p == '\n') cur->line_begin[a++] = offset + (p - ins) + 1;
+}
+
+/*
+ * インクリメンタルな再字句解析
+ * src の offset から del 文字を ins に置き換えた新しいソースを返し、tokens を作り直す。
+ * 編集位置より前しか読んでいない最後の字句の直後から解析を再開し、
+ * 編集範囲より後ろで古い字句 (位置をずらしたもの) と種類・位置が揃ったら打ち切る。
+ */
+static char* relex_tokens(char* src,int size,int offset,int del,char* ins,int* new_size){
+	Lexer* lex = &cur->lex;
+	int ins_len = strlen(ins);
+	int delta = ins_len - del;
+	int lo, hi, restart, scan, i, j, k;
+	struct token *fresh = NULL;
+	int fresh_num = 0, fresh_alloced = 0;
+	char* dst;
+
+	assert(0 <= offset && 0 <= del && offset + del <= size);
+
+	dst = xmalloc(size + delta);
+	memcpy(dst,src,offset);
+	memcpy(dst + offset,ins,ins_len);
+	memcpy(dst + offset + ins_len,src + offset + del,size - offset - del);
+	*new_size = size + delta;
+	update_line_index(offset,del,ins);
+
+	// offset_scan は先頭からの最大値なので単調、二分探索で再開位置を決める
+	lo = 0; hi = cur->tokens_index;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(cur->tokens[mid].offset_scan < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	k = lo; // tokens[0..k) はそのまま使える
+	restart = k > 0 ? cur->tokens[k-1].offset_end : 0;
+	scan    = k > 0 ? cur->tokens[k-1].offset_scan : -1;
+
+	resetLex(lex,dst,*new_size);
+	seekLex(lex,restart);
+
+	// 古い字句の中から対応する位置のものを探しつつ、同期するまで読む
+	j = k;
+	for(;;){
+		struct token t;
+		if(!lex_token(lex,dst,&restart,&scan,&t)){
+			j = cur->tokens_index; // 最後まで読んだ
+			break;
+		}
+		if(t.offset_begin >= offset + ins_len){
+			while(j < cur->tokens_index && cur->tokens[j].offset_begin + delta < t.offset_begin) j++;
+			if(j < cur->tokens_index && cur->tokens[j].offset_begin + delta == t.offset_begin
+			   && cur->tokens[j].kind == t.kind){
+				free(t.lexeme);
+				break;
+			}
+		}
+		if(fresh_num == fresh_alloced){
+			fresh_alloced = fresh_alloced ? fresh_alloced * 2 : 16;
+			fresh = xrealloc(fresh,sizeof(struct token) * fresh_alloced);
+		}
+		fresh[fresh_num++] = t;
+	}
+
+	// tokens[k..j) を fresh に置き換え、残りは位置をずらす
+	for(i = k;i < j;i++) free(cur->tokens[i].lexeme);
+	reserve_tokens(k + fresh_num + (cur->tokens_index - j));
+	memmove(&cur->tokens[k + fresh_num],&cur->tokens[j],sizeof(struct token) * (cur->tokens_index - j));
+	if(fresh_num) memcpy(&cur->tokens[k],fresh,sizeof(struct token) * fresh_num); // 字句が無ければ fresh は NULL
+	for(i = k + fresh_num;i < k + fresh_num + (cur->tokens_index - j);i++){
+		cur->tokens[i].offset_begin += delta;
+		cur->tokens[i].offset_end   += delta;
+		cur->tokens[i].offset_scan  += delta;
+		if(cur->tokens[i].offset_scan < scan) cur->tokens[i].offset_scan = scan;
+	}
+	i = cur->tokens_index;
+	cur->tokens_index = k + fresh_num + (cur->tokens_index - j);
+	if(cur->tokens_index < i) memset(&cur->tokens[cur->tokens_index],0,sizeof(struct token) * (i - cur->tokens_index));
+
+	free(fresh);
+	return dst;
 }
 
 static void dump_tokens ()
 {
     int i;
-    for (i = 0; i < MAX_TOKENS; i++) {
-        struct token *token_p = &tokens [i];
-        if (token_p->kind == TK_UNUSED)
+    for (i = 0; i < cur->tokens_alloced; i++) {
+        struct token *t = &cur->tokens [i];
+        if (t->kind == TK_UNUSED)
             break;
-        printf ("%5d: %d-%d: %s (%s)\n", i,
-                token_p->offset_begin,
-                token_p->offset_end,
-                token_p->lexeme,
-                token_kind_string [token_p->kind]);
+        int line, col;
+        offset_to_linecol (t->offset_begin, &line, &col);
+        fprintf (cur->out, "%5d: %d-%d (%d:%d): %s (%s)\n", i,
+                t->offset_begin,
+                t->offset_end,
+                line, col,
+                t->lexeme,
+                token_kind_string [t->kind]);
     }
 }
 /* ------------------------------------------------------- */
 static void
-unparse_error (struct AST *ast)
+unparse_error (ast_id ast)
 {
-    printf ("something wrong: %s\n", ast->ast_type);
-    exit (1);
+    fprintf (cur->out, "something wrong: %s\n", ast_name (ast));
+    longjmp (cur->error, 1);
 }
 
-#define CASE(rule) if(!strcmp(ast->ast_type,rule))
-#define ECASE(rule) else CASE(rule)
-#define OTHERWISE   else
-
 static void indent(int d){
-	for(;d--;) printf("    ");
+	for(;d--;) fprintf(cur->out,"    ");
 }
 
-static void unparse_AST (struct AST *ast, int depth){
+// unparse で書くものを walk に前から積む
+static void u_str(const char* str){
+	walk_push(W_STR,AST_NONE,0)->str = str;
+}
+
+static void u_node(ast_id ast,int depth){
+	walk_push(W_NODE,ast,depth);
+}
+
+static void u_indent(int depth){
+	walk_push(W_INDENT,AST_NONE,depth);
+}
+
+// 1つのノードを、書く文字列と子の unparse の並びに展開する
+static void unparse_node (ast_id ast, int depth){
 	int i;
 
-	if(ast == NULL){
-		printf("!!! null pointer !!!\n");
+	if(ast == AST_NONE){
+		fprintf(cur->out,"!!! null pointer !!!\n");
 		return;
 	}
-	
-	int cnum = ast->num_child;
-	struct AST** child = ast->child;
-	//printf("[%s]\n",ast->ast_type);
-
-	CASE("translation_unit"){
-		for(i=0;i<cnum;i++){
-			unparse_AST(child[i],depth);
-			printf("\n");
-		}
-	}
 
-	ECASE("translation_unit_element"){
-		unparse_AST(child[0],depth);
-		printf(" ");
-		unparse_AST(child[1],depth);
-		if(cnum == 2){
-			printf(";\n");
-		}
-		else {
-			unparse_AST(child[2],depth);
-			printf("\n");
-		}
-	}
+	int top = cur->walk_num;
+	int cnum = ast_node(ast)->num_child;
+	ast_id* child = ast_children(ast);
+	//printf("[%s]\n",ast_name(ast));
 
-	ECASE("type_specifier"){
-		printf("%s",child[0]->lexeme);
-	}
+	switch(ast_node(ast)->kind){
+		case AST_TRANSLATION_UNIT:
+			for(i=0;i<cnum;i++){
+				u_node(child[i],depth);
+				u_str("\n");
+			}
+			break;
 
-	ECASE("declarator"){
-		for(i=0;i<cnum-1;i++) printf("%s",child[i]->lexeme);
-		//printf(" ");
-		unparse_AST(child[i],depth);
-	}
+		case AST_TRANSLATION_UNIT_ELEMENT:
+			u_node(child[0],depth);
+			u_str(" ");
+			u_node(child[1],depth);
+			if(cnum == 2){
+				u_str(";\n");
+			}
+			else {
+				u_node(child[2],depth);
+				u_str("\n");
+			}
+			break;
 
-	ECASE("direct_declarator"){
-		if(!strcmp(child[0]->ast_type,"TK_ID")){
-			printf("%s",child[0]->lexeme);
-		}
-		else{
-			printf("(");
-			unparse_AST(child[0],depth);
-			printf(")");
-		}
+		case AST_TYPE_SPECIFIER:
+			u_str(ast_lexeme(child[0]));
+			break;
 
-		if(cnum > 1){
-			for(i=1;i<cnum;i++) unparse_AST(child[i],depth);
-		}
-	}
+		case AST_DECLARATOR:
+			for(i=0;i<cnum-1;i++) u_str(ast_lexeme(child[i]));
+			//printf(" ");
+			u_node(child[i],depth);
+			break;
 
-	ECASE("direct_declarator_parameter"){
-		printf("(");
-		if(cnum > 0){
-			unparse_AST(child[0],depth);
-			for(i=1;i<cnum;i++){
-				printf(",");
-				unparse_AST(child[i],depth);
+		case AST_DIRECT_DECLARATOR:
+			if(ast_node(child[0])->kind == AST_ID){
+				u_str(ast_lexeme(child[0]));
+			}
+			else{
+				u_str("(");
+				u_node(child[0],depth);
+				u_str(")");
 			}
-		}
-		printf(")");
-	}
 
-	ECASE("parameter_declaration"){
-		unparse_AST(child[0],depth);
-		printf(" ");
-		unparse_AST(child[1],depth);
-	}
+			if(cnum > 1){
+				for(i=1;i<cnum;i++) u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("statement_label"){
-		printf("%s : \n",child[0]->lexeme);
-	}
+		case AST_DIRECT_DECLARATOR_PARAMETER:
+			u_str("(");
+			if(cnum > 0){
+				u_node(child[0],depth);
+				for(i=1;i<cnum;i++){
+					u_str(",");
+					u_node(child[i],depth);
+				}
+			}
+			u_str(")");
+			break;
 
-	ECASE("statement_exp"){
-		unparse_AST(child[0],depth);
-		printf(";\n");
-	}
+		case AST_PARAMETER_DECLARATION:
+			u_node(child[0],depth);
+			u_str(" ");
+			u_node(child[1],depth);
+			break;
 
-	ECASE("statement_if"){
-		printf("if(");
-		unparse_AST(child[0],depth);
-		printf(")");
-		if(!strcmp(child[1]->ast_type,"compound_statement"))
-			unparse_AST(child[1],depth);
-		else {
-			printf("{\n");
-			indent(depth+1);
-			unparse_AST(child[1],depth+1);
-			indent(depth); printf("}\n");
-		}
+		case AST_STATEMENT_LABEL:
+			u_str(ast_lexeme(child[0])); u_str(" : \n");
+			break;
+
+		case AST_STATEMENT_EXP:
+			u_node(child[0],depth);
+			u_str(";\n");
+			break;
 
-		if(cnum == 3){
-			indent(depth);
-			printf("else");
-			if(!strcmp(child[2]->ast_type,"compound_statement"))
-				unparse_AST(child[2],depth);
+		case AST_STATEMENT_IF:
+			u_str("if(");
+			u_node(child[0],depth);
+			u_str(")");
+			if(ast_node(child[1])->kind == AST_COMPOUND_STATEMENT)
+				u_node(child[1],depth);
 			else {
-				printf("{\n");
-				indent(depth+1);
-				unparse_AST(child[2],depth+1);
-				indent(depth); printf("}\n");
+				u_str("{\n");
+				u_indent(depth+1);
+				u_node(child[1],depth+1);
+				u_indent(depth); u_str("}\n");
 			}
-		}
 
-		//printf("\n");
-	}
+			if(cnum == 3){
+				u_indent(depth);
+				u_str("else");
+				if(ast_node(child[2])->kind == AST_COMPOUND_STATEMENT)
+					u_node(child[2],depth);
+				else {
+					u_str("{\n");
+					u_indent(depth+1);
+					u_node(child[2],depth+1);
+					u_indent(depth); u_str("}\n");
+				}
+			}
 
-	ECASE("statement_while"){
-		printf("while(");
-		unparse_AST(child[0],depth);
-		printf(") ");
-		unparse_AST(child[1],depth);
-		//printf("\n");
-	}
+			//printf("\n");
+			break;
 
-	ECASE("statement_goto"){
-		printf("goto %s;\n",child[0]->lexeme);
-	}
+		case AST_STATEMENT_WHILE:
+			u_str("while(");
+			u_node(child[0],depth);
+			u_str(") ");
+			u_node(child[1],depth);
+			//printf("\n");
+			break;
 
-	ECASE("statement_return"){
-		printf("return");
-		if(cnum == 1){
-			printf(" ");
-			unparse_AST(child[0],depth);
-		}
-		printf(";\n");
-	}
+		case AST_STATEMENT_GOTO:
+			u_str("goto "); u_str(ast_lexeme(child[0])); u_str(";\n");
+			break;
 
-	ECASE("compound_statement"){
-		printf("{\n");
-
-		i=0;
-		while(i < cnum && !strcmp(child[i]->ast_type,"type_specifier")){
-			indent(depth+1);
-			unparse_AST(child[i],depth+1);
-			printf(" ");
-			unparse_AST(child[i+1],depth+1);
-			printf(";\n");
-			i+=2;
-		}
-		for(;i<cnum;i++){
-			indent(depth+1);
-			unparse_AST(child[i],depth+1);
-			//printf("\n");
-		}
+		case AST_STATEMENT_RETURN:
+			u_str("return");
+			if(cnum == 1){
+				u_str(" ");
+				u_node(child[0],depth);
+			}
+			u_str(";\n");
+			break;
 
-		indent(depth); printf("}\n");
-	}
+		case AST_COMPOUND_STATEMENT:
+			u_str("{\n");
+
+			i=0;
+			while(i < cnum && ast_node(child[i])->kind == AST_TYPE_SPECIFIER){
+				u_indent(depth+1);
+				u_node(child[i],depth+1);
+				u_str(" ");
+				u_node(child[i+1],depth+1);
+				u_str(";\n");
+				i+=2;
+			}
+			for(;i<cnum;i++){
+				u_indent(depth+1);
+				u_node(child[i],depth+1);
+				//printf("\n");
+			}
 
-	ECASE("exp"){
-		unparse_AST(child[0],depth);
-	}
+			u_indent(depth); u_str("}\n");
+			break;
 
-	ECASE("exp9"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(" = ");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP:
+			u_node(child[0],depth);
+			break;
 
-	ECASE("exp8"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(" || ");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP9:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(" = ");
+				u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("exp7"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(" && ");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP8:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(" || ");
+				u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("exp6"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(" == ");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP7:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(" && ");
+				u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("exp5"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(" < ");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP6:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(" == ");
+				u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("exp4"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i+=2){
-			printf(" %s ",child[i]->lexeme);
-			unparse_AST(child[i+1],depth);
-		}
-	}
+		case AST_EXP5:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(" < ");
+				u_node(child[i],depth);
+			}
+			break;
 
-	ECASE("exp3"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i+=2){
-			printf(" %s ",child[i]->lexeme);
-			unparse_AST(child[i+1],depth);
-		}
-	}
+		case AST_EXP4:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i+=2){
+				u_str(" "); u_str(ast_lexeme(child[i])); u_str(" ");
+				u_node(child[i+1],depth);
+			}
+			break;
 
-	ECASE("exp2"){
-		for(i=0;i<cnum-1;i++) printf("%s",child[i]->lexeme);
-		unparse_AST(child[i],depth);
-	}
-	
-	ECASE("exp1"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf("(");
-			unparse_AST(child[i],depth);
-			printf(")");
-		}
-	}
-	
-	ECASE("primary"){
-		printf("(");
-		unparse_AST(child[0],depth);
-		printf(")");
-	}
-	
-	ECASE("argument_expression_list"){
-		unparse_AST(child[0],depth);
-		for(i=1;i<cnum;i++){
-			printf(",");
-			unparse_AST(child[i],depth);
-		}
-	}
+		case AST_EXP3:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i+=2){
+				u_str(" "); u_str(ast_lexeme(child[i])); u_str(" ");
+				u_node(child[i+1],depth);
+			}
+			break;
 
-	ECASE("exp_empty"){
-		printf(" ");
-	}
+		case AST_EXP2:
+			for(i=0;i<cnum-1;i++) u_str(ast_lexeme(child[i]));
+			u_node(child[i],depth);
+			break;
 
-	ECASE("TK_ID"){
-		printf("%s",ast->lexeme);
-	}
-	
-	ECASE("TK_INT"){
-		printf("%s",ast->lexeme);
-	}
-	
-	ECASE("TK_CHAR"){
-		printf("%s",ast->lexeme);
-	}
-	
-	ECASE("TK_STRING"){
-		printf("%s",ast->lexeme);
+		case AST_EXP1:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str("(");
+				u_node(child[i],depth);
+				u_str(")");
+			}
+			break;
+
+		case AST_PRIMARY:
+			u_str("(");
+			u_node(child[0],depth);
+			u_str(")");
+			break;
+
+		case AST_ARGUMENT_EXPRESSION_LIST:
+			u_node(child[0],depth);
+			for(i=1;i<cnum;i++){
+				u_str(",");
+				u_node(child[i],depth);
+			}
+			break;
+
+		case AST_EXP_EMPTY:
+			u_str(" ");
+			break;
+
+		case AST_ID:
+		case AST_INT:
+		case AST_CHAR:
+		case AST_STRING:
+			u_str(ast_lexeme(ast));
+			break;
+
+		default: unparse_error(ast);
 	}
 
-	OTHERWISE unparse_error(ast);
+	walk_reverse(top);
+}
+
+static void unparse_AST (ast_id ast, int depth){
+	int base = cur->walk_num;
+	u_node(ast,depth);
+	while(cur->walk_num > base){
+		struct walk w = cur->walk[--cur->walk_num];
+		switch(w.op){
+			case W_STR:    fputs(w.str,cur->out); break;
+			case W_INDENT: indent(w.arg); break;
+			case W_NODE:   unparse_node(w.ast,w.arg); break;
+		}
+	}
 }
 
 
@@ -1245,61 +2095,76 @@ void print_escape_string(FILE* fp,char* p){
 	}
 }
 
-int output_graph_node(FILE* fp,struct AST* ast,int id){
-	assert(ast != NULL);
+// 木を行きがけ順にたどって、id から順に番号を付けたノードを書く (次の番号を返す)
+int output_graph_node(FILE* fp,ast_id root,int id){
+	int base = cur->walk_num;
+	walk_push(W_NODE,root,0);
+
+	while(cur->walk_num > base){
+		ast_id ast = cur->walk[--cur->walk_num].ast;
+		assert(ast != AST_NONE);
+		struct AST* n = ast_node(ast);
+		char* lexeme = ast_lexeme(ast);
 	
-	if(ast->num_child == 0){
-		if(ast->lexeme != NULL){
-			fprintf(fp,"    node%d [label = \"{%s|",id,ast->ast_type);
-			print_escape_string(fp,ast->lexeme);
-			fprintf(fp,"}\"]; \n");
+		if(n->num_child == 0){
+			if(lexeme != NULL){
+				fprintf(fp,"    node%d [label = \"{%s|",id,ast_name(ast));
+				print_escape_string(fp,lexeme);
+				fprintf(fp,"}\"]; \n");
+			}
+			else {
+				fprintf(fp,"    node%d [label = \"%s\"]; \n",id,ast_name(ast));
+			}
 		}
 		else {
-			fprintf(fp,"    node%d [label = \"%s\"]; \n",id,ast->ast_type);
-		}
-	}
-	else {
-		if(ast->lexeme != NULL){
-			fprintf(fp,"    node%d [label = \"{%s|",id,ast->ast_type);
-			print_escape_string(fp,ast->lexeme);
-			fprintf(fp,"}\"]; \n");
-		}
-		else{
-			fprintf(fp,"    node%d [label = \"{%s|{", id, ast->ast_type);
-		}
+			if(lexeme != NULL){
+				fprintf(fp,"    node%d [label = \"{%s|",id,ast_name(ast));
+				print_escape_string(fp,lexeme);
+				fprintf(fp,"}\"]; \n");
+			}
+			else{
+				fprintf(fp,"    node%d [label = \"{%s|{", id, ast_name(ast));
+			}
 
-		for(int i=0;i < ast->num_child;i++){
-			if(i != 0) fprintf(fp,"|");
-			fprintf(fp,"<p%d>%i",i,i);
-		}
+			for(int i=0;i < n->num_child;i++){
+				if(i != 0) fprintf(fp,"|");
+				fprintf(fp,"<p%d>%i",i,i);
+			}
 	
-		fprintf(fp,"}}\"]; \n");
-	}
+			fprintf(fp,"}}\"]; \n");
+		}
 
-	int acc = id+1;
-	
-	for(int i = 0;i < ast->num_child;i++){
-		acc = output_graph_node(fp,ast->child[i],acc);
+		id++;
+		for(int i = n->num_child;i-- > 0;){
+			walk_push(W_NODE,ast_children(ast)[i],0);
+		}
 	}
 
-	return acc;
+	return id;
 }
 
-int output_graph_edge(FILE* fp,struct AST* ast,int parent_id,int pos,int id){
-	if(id != 0){
-		fprintf(fp,"    node%d:p%d -> node%d ;\n",parent_id,pos,id);
-	}
+// output_graph_node と同じ番号で、親の p<pos> から子への辺を書く
+int output_graph_edge(FILE* fp,ast_id root,int parent_id,int pos,int id){
+	int base = cur->walk_num;
+	walk_push(W_NODE,root,parent_id)->pos = pos;
 
-	int acc = id+1;
+	while(cur->walk_num > base){
+		struct walk w = cur->walk[--cur->walk_num];
+		struct AST* n = ast_node(w.ast);
+		if(id != 0){
+			fprintf(fp,"    node%d:p%d -> node%d ;\n",w.arg,w.pos,id);
+		}
 
-	for(int i = 0;i < ast->num_child;i++){
-		acc = output_graph_edge(fp,ast->child[i],id,i,acc);
+		for(int i = n->num_child;i-- > 0;){
+			walk_push(W_NODE,ast_children(w.ast)[i],id)->pos = i;
+		}
+		id++;
 	}
 
-	return acc;
+	return id;
 }
 
-void output_graph(char* name,struct AST* ast){
+void output_graph(char* name,ast_id ast){
 
 // 変数に入れるとwarning出るのでdefineで定義	
 #define DOT_HEADER "digraph AST_graph {              \n"\
@@ -1340,29 +2205,301 @@ void output_graph(char* name,struct AST* ast){
 /* ------------------------------------------------------- */
 
 
-int main (int argc, char *argv[])
+/*
+ * 1つのファイルを字句解析・構文解析して c->out に unparse する
+ * エラーは c->err (字句エラーと unparse のエラーは c->out) に "ファイル名:行:桁: " を付けて書いて 1 を返す
+ */
+static int compile_file (struct compilation *c, char *graph, char *edit, int opt_dump_tokens)
 {
-    char *ptr;
-    struct AST *ast;
+    ast_id ast;
+    int ret = 0;
+
+    cur = c;
+    c->lex = openLex (&lex_rules, NULL, 0);
+    if (setjmp (c->error)) {
+        ret = 1;
+        goto cleanup;
+    }
 
-    if (argc < 2) {
-        fprintf (stderr, "Usage: %s filename\n", argv[0]);
-        exit (1);
+    phase_begin (PHASE_MAP);
+    c->src = map_file (c->input, &c->src_size);
+    c->src_mapped = 1;
+    phase_end ();
+
+    phase_begin (PHASE_LEX);
+    create_tokens (c->src, c->src_size);
+    if (edit != NULL) { // 編集を1つ適用して差分だけ字句解析し直す
+        int offset, del, n = 0;
+        if (sscanf (edit, "%d,%d,%n", &offset, &del, &n) < 2 || n == 0
+            || offset < 0 || del < 0 || offset + del > c->src_size) {
+            fprintf (c->err, "%s: bad --edit: %s\n", c->input, edit);
+            longjmp (c->error, 1);
+        }
+        int size = c->src_size;
+        char *src = relex_tokens (c->src, size, offset, del, edit + n, &c->src_size);
+        unmap_file (c->src, size);
+        c->src = src;
+        c->src_mapped = 0;
     }
+    c->num_tokens = c->tokens_index;
+    phase_end ();
 
-    ptr = map_file (argv [1]);
-    create_tokens (ptr);
     reset_tokens ();
 	//printf("/*++++++++++++++++++++++++++++++++++++\n");
-    //dump_tokens ();
+    if (opt_dump_tokens) dump_tokens ();
 	//printf("------------------------------------\n");
+    phase_begin (PHASE_PARSE);
     ast = parse_translation_unit ();
+    phase_end ();
     //show_AST (ast, 0);
 	//printf("------------------------------------\n");
 	//printf("output graph.\n");
-	if(argc == 3) output_graph(argv[2],ast);
+	if(graph != NULL){
+		phase_begin (PHASE_GRAPH);
+		output_graph(graph,ast);
+		phase_end ();
+	}
 	//printf("++++++++++++++++++++++++++++++++++++*/\n");
+    phase_begin (PHASE_UNPARSE);
     unparse_AST (ast, 0);
+    fflush (c->out);
+    phase_end ();
+
+cleanup:
+    for (int i = 0; i < c->tokens_alloced && c->tokens [i].kind != TK_UNUSED; i++)
+        free (c->tokens [i].lexeme);
+    free (c->tokens);
+    c->tokens = NULL;
+    c->tokens_alloced = 0;
+    free (c->line_begin);
+    if (c->src != NULL) {
+        if (c->src_mapped) unmap_file (c->src, c->src_size);
+        else free (c->src);
+    }
+    free (c->nodes);                   // 構文木はここでまとめて捨てる
+    free (c->kids);
+    c->nodes = NULL;
+    c->kids = NULL;
+    c->num_nodes = c->nodes_alloced = c->num_kids = c->kids_alloced = 0;
+    free (c->scratch);
+    c->scratch = NULL;
+    c->scratch_num = c->scratch_alloced = 0;
+    free (c->pstack);
+    c->pstack = NULL;
+    c->pstack_num = c->pstack_alloced = 0;
+    free (c->walk);
+    c->walk = NULL;
+    c->walk_num = c->walk_alloced = 0;
+    closeLex (&c->lex);
+    cur = NULL;
+    return ret;
 }
 
+/* ------------------------------------------------------- */
+// --batch : 複数ファイルをスレッドプールで並列にコンパイルする
+
+struct batch_job {
+    struct compilation *c;
+    char *out_buf, *err_buf;   // open_memstream で貯めた出力
+    size_t out_len, err_len;
+    int status;
+};
+
+struct batch {
+    struct batch_job *jobs;
+    int num_jobs;
+    int next;                  // 次に取るジョブ
+    int workers;               // 起動したワーカーの数 (--trace のスレッド番号)
+    int opt_dump_tokens;
+    pthread_mutex_t lock;
+};
 
+static void run_job (struct batch *b, struct batch_job *job)
+{
+    job->c->out = open_memstream (&job->out_buf, &job->out_len);
+    job->c->err = open_memstream (&job->err_buf, &job->err_len);
+    job->status = compile_file (job->c, NULL, NULL, b->opt_dump_tokens);
+    fclose (job->c->out);
+    fclose (job->c->err);
+}
+
+static void* batch_worker (void *arg)
+{
+    struct batch *b = arg;
+    pthread_mutex_lock (&b->lock);
+    int tid = ++b->workers;
+    pthread_mutex_unlock (&b->lock);
+    for (;;) {
+        pthread_mutex_lock (&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock (&b->lock);
+        if (i >= b->num_jobs) break;
+        b->jobs [i].c->trace_tid = tid;
+        run_job (b, &b->jobs [i]);
+    }
+    return NULL;
+}
+
+// 出力は入力の順に並べるので、スレッド数によらず同じになる
+static int run_batch (char **inputs, int n, int jobs, int opt_dump_tokens)
+{
+    struct batch b;
+    pthread_t *th;
+    int i, status = 0;
+
+    b.jobs = calloc (n, sizeof (struct batch_job));
+    b.num_jobs = n;
+    b.next = 0;
+    b.workers = 0;
+    b.opt_dump_tokens = opt_dump_tokens;
+    pthread_mutex_init (&b.lock, NULL);
+    for (i = 0; i < n; i++) {
+        b.jobs [i].c = calloc (1, sizeof (struct compilation));
+        b.jobs [i].c->input = inputs [i];
+    }
+
+    if (jobs > n) jobs = n;
+    if (jobs <= 1) {
+        batch_worker (&b);
+    } else {
+        th = malloc (sizeof (pthread_t) * jobs);
+        for (i = 0; i < jobs; i++) pthread_create (&th [i], NULL, batch_worker, &b);
+        for (i = 0; i < jobs; i++) pthread_join (th [i], NULL);
+        free (th);
+    }
+
+    for (i = 0; i < n; i++) {
+        struct batch_job *job = &b.jobs [i];
+        printf ("/* %s */\n", job->c->input);
+        fwrite (job->out_buf, 1, job->out_len, stdout);
+        fflush (stdout);
+        if (job->err_len > 0) fprintf (stderr, "/* %s */\n", job->c->input);
+        fwrite (job->err_buf, 1, job->err_len, stderr);
+        free (job->out_buf);
+        free (job->err_buf);
+        status |= job->status;
+    }
+
+    if (opt_stats || opt_trace) {
+        struct compilation **cs = malloc (sizeof (struct compilation *) * n);
+        for (i = 0; i < n; i++) cs [i] = b.jobs [i].c;
+        if (opt_stats) print_stats (cs, n);
+        if (opt_trace) write_trace (cs, n);
+        free (cs);
+    }
+    for (i = 0; i < n; i++) {
+        trace_free (&b.jobs [i].c->trace);
+        free (b.jobs [i].c);
+    }
+    free (b.jobs);
+    pthread_mutex_destroy (&b.lock);
+    return status;
+}
+
+// --files-from : 1行に1ファイル名
+static char** read_file_list (char *list, char **inputs, int *n, int *alloced)
+{
+    FILE *fp = strcmp (list, "-") ? fopen (list, "r") : stdin;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (fp == NULL) {
+        perror (list);
+        exit (1);
+    }
+    while ((len = getline (&line, &cap, fp)) != -1) {
+        while (len > 0 && (line [len-1] == '\n' || line [len-1] == '\r')) line [--len] = '\0';
+        if (len == 0) continue;
+        if (*n == *alloced) {
+            *alloced = *alloced ? *alloced * 2 : 64;
+            inputs = realloc (inputs, sizeof (char *) * *alloced);
+        }
+        inputs [(*n)++] = strdup (line);
+    }
+    free (line);
+    if (fp != stdin) fclose (fp);
+    return inputs;
+}
+
+/* ------------------------------------------------------- */
+
+
+int main (int argc, char *argv[])
+{
+    char **inputs = NULL, *graph = NULL, *edit = NULL;
+    int i, n = 0, alloced = 0, status;
+    int opt_dump_tokens = 0, opt_batch = 0;
+    int jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp (argv [i], "--lex-stats")) {
+            opt_lex_stats = 1;
+        } else if (!strcmp (argv [i], "--stats")) {
+            opt_stats = 1;
+        } else if (!strcmp (argv [i], "--huge-pages")) {
+            opt_huge_pages = 1;
+        } else if (!strncmp (argv [i], "--trace=", 8)) {
+            opt_trace = argv [i] + 8;
+        } else if (!strncmp (argv [i], "--lex-dot=", 10)) {
+            opt_lex_dot = argv [i] + 10;
+        } else if (!strcmp (argv [i], "--stack-parse")) {
+            opt_stack_parse = 1;
+        } else if (!strcmp (argv [i], "--dump-tokens")) {
+            opt_dump_tokens = 1;
+        } else if (!strncmp (argv [i], "--edit=", 7)) {
+            edit = argv [i] + 7;
+        } else if (!strcmp (argv [i], "--batch")) {
+            opt_batch = 1;
+        } else if (!strncmp (argv [i], "--files-from=", 13)) {
+            opt_batch = 1;
+            inputs = read_file_list (argv [i] + 13, inputs, &n, &alloced);
+        } else if (!strncmp (argv [i], "--jobs=", 7)) {
+            jobs = atoi (argv [i] + 7);
+        } else if (!strcmp (argv [i], "-j") && i + 1 < argc) {
+            jobs = atoi (argv [++i]);
+        } else if (!strncmp (argv [i], "-j", 2) && argv [i][2] != '\0') {
+            jobs = atoi (argv [i] + 2);
+        } else if (opt_batch || n == 0) {
+            if (n == alloced) {
+                alloced = alloced ? alloced * 2 : 64;
+                inputs = realloc (inputs, sizeof (char *) * alloced);
+            }
+            inputs [n++] = strdup (argv [i]); // --files-from の分と同じように最後に解放する
+        } else {
+            graph = argv [i];
+        }
+    }
+
+    if (n == 0 || (opt_batch && (edit != NULL || graph != NULL || opt_lex_dot != NULL))) {
+        fprintf (stderr, "Usage: %s [--stats] [--lex-stats] [--lex-dot=FILE] [--trace=FILE] [--huge-pages] [--stack-parse] [--dump-tokens] [--edit=OFFSET,DELETE,TEXT] filename [graph.dot]\n"
+                         "       %s --batch [-j N] [--files-from=LIST] [--stats] [--lex-stats] [--trace=FILE] [--huge-pages] [--stack-parse] [--dump-tokens] filename...\n",
+                 argv[0], argv[0]);
+        exit (1);
+    }
+
+    // 規則は一度だけコンパイルして、各ファイルの Lexer で共有する
+    trace_t0 = trace_now ();
+    lex_rules = compileLexRules (token_table, sizeof(token_table)/sizeof(SymbolElement));
+    if (opt_trace) trace_add (&main_trace, "lexer compile", NULL, trace_t0, 0);
+
+    if (opt_batch) {
+        status = run_batch (inputs, n, jobs, opt_dump_tokens);
+    } else {
+        struct compilation *c = calloc (1, sizeof (struct compilation));
+        c->input = inputs [0];
+        c->out = stdout;
+        c->err = stderr;
+        status = compile_file (c, graph, edit, opt_dump_tokens);
+        if (opt_stats && status == 0) print_stats (&c, 1);
+        if (opt_trace) write_trace (&c, 1);
+        trace_free (&c->trace);
+        free (c);
+    }
+
+    freeLexRules (&lex_rules);
+    trace_free (&main_trace);
+    for (i = 0; i < n; i++) free (inputs [i]);
+    free (inputs);
+    return status;
+}